@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midilib.h"
+
+
+/*
+	Arena.
+
+	The space a conversion needs until the MIDIFile is reset or freed -- the channels' note slots,
+	the event index, the tempo map, and the copy of the file when it is read rather than mapped --
+	is carved from an arena by bumping a pointer, and given back all at once by midi_arena_reset,
+	which just rewinds it. Nothing is freed one piece at a time, so a worker converting file after
+	file with the same arena stops calling malloc once the arena is big enough for its biggest file.
+
+	When a piece doesn't fit, another block is chained on, at least as big as all the others put
+	together. The next reset frees the chain and allocates one block of the whole size instead,
+	so the arena settles at a single block and a reset is then only the rewind.
+
+	Buffers grow by doubling, as they do with realloc. The latest piece grows where it is if there
+	is room after it; any other is copied, and the space it leaves stays unused until the reset.
+	All the functions take a NULL arena to mean malloc, realloc and free, for the buffers that are
+	kept apart from a MIDIFile.
+*/
+
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER ((sizeof(MIDIArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// the start of a block's space
+byte *arena_space(MIDIArenaBlock *block) {
+
+	return (byte*)block + ARENA_HEADER;
+}
+
+size_t arena_round(size_t len) {
+
+	return (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+MIDIArenaBlock *arena_new_block(MIDIArena *arena, size_t size) {
+
+	MIDIArenaBlock *block = (MIDIArenaBlock*)malloc(ARENA_HEADER + size);
+	if (!block) return NULL;
+	block->prev = arena->block;
+	block->size = size;
+	block->used = 0;
+	arena->block = block;
+	arena->total += size;
+	return block;
+}
+
+/// Start an empty arena, which allocates blocks of at least block_size bytes (0 for MIDI_ARENA_BLOCK)
+void midi_arena_init(MIDIArena *arena, size_t block_size) {
+
+	memset(arena, 0, sizeof(MIDIArena));
+	arena->block_size = block_size;
+}
+
+/// Take len bytes, aligned for anything; with a NULL arena, malloc them
+void *midi_arena_alloc(MIDIArena *arena, size_t len) {
+
+	if (!arena) return malloc(len);
+
+	len = arena_round(len);
+	MIDIArenaBlock *block = arena->block;
+	if (!block || block->size - block->used < len) {
+		size_t size = arena->block_size ? arena->block_size : MIDI_ARENA_BLOCK;
+		if (size < arena->total) size = arena->total;
+		if (size < len) size = len;
+		if (!(block = arena_new_block(arena, size))) return NULL;
+	}
+
+	byte *space = arena_space(block) + block->used;
+	block->used += len;
+	arena->used += len;
+	if (arena->used > arena->highwater) arena->highwater = arena->used;
+	arena->last = space;
+	return space;
+}
+
+/// Make the space at ptr, which was old_len bytes, len bytes, keeping what's in it, like realloc
+void *midi_arena_grow(MIDIArena *arena, void *ptr, size_t old_len, size_t len) {
+
+	if (!arena) return realloc(ptr, len);
+	if (!ptr) return midi_arena_alloc(arena, len);
+
+	MIDIArenaBlock *block = arena->block;
+	if (ptr == arena->last) { // the latest piece: grow it where it is if it fits
+		size_t start = (byte*)ptr - arena_space(block);
+		size_t old_end = block->used;
+		if (block->size - start >= arena_round(len)) {
+			block->used = start + arena_round(len);
+			arena->used += block->used - old_end;
+			if (arena->used > arena->highwater) arena->highwater = arena->used;
+			return ptr;
+		}
+	}
+
+	void *space = midi_arena_alloc(arena, len);
+	if (space) memcpy(space, ptr, old_len < len ? old_len : len);
+	return space;
+}
+
+/// Give back the space at ptr, which only makes it reusable before the reset if it was the latest piece
+void midi_arena_drop(MIDIArena *arena, void *ptr) {
+
+	if (!arena) {
+		free(ptr);
+		return;
+	}
+	if (ptr && ptr == arena->last) {
+		MIDIArenaBlock *block = arena->block;
+		size_t start = (byte*)ptr - arena_space(block);
+		arena->used -= block->used - start;
+		block->used = start;
+		arena->last = NULL;
+	}
+}
+
+/// Give back everything taken since the last reset; the blocks are kept to carve up again
+void midi_arena_reset(MIDIArena *arena) {
+
+	MIDIArenaBlock *block = arena->block;
+	if (block && block->prev) { // more than one block: make them one for next time
+		size_t total = arena->total;
+		midi_arena_free(arena);
+		arena_new_block(arena, total);
+	}
+	else if (block) block->used = 0;
+
+	arena->last = NULL;
+	arena->used = 0;
+	arena->resets++;
+}
+
+/// Free the blocks; the arena is then empty, and can be used again
+void midi_arena_free(MIDIArena *arena) {
+
+	MIDIArenaBlock *block = arena->block;
+	while (block) {
+		MIDIArenaBlock *prev = block->prev;
+		free(block);
+		block = prev;
+	}
+	arena->block = NULL;
+	arena->last = NULL;
+	arena->total = 0;
+	arena->used = 0;
+}
+
+/// Have midi carve its space from arena, which belongs to the caller, instead of from its own.
+/// Only on a MIDIFile with nothing loaded, new or after midi_reset; midi_reset then resets arena,
+/// so it can only be used by one MIDIFile at a time. NULL goes back to the MIDIFile's own arena.
+void midi_set_arena(MIDIFile *midi, MIDIArena *arena) {
+
+	midi->arena = arena ? arena : &midi->own_arena;
+	midi->tempo_map.arena = midi->arena;
+}
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "midilib.h"
+
+
+/*
+	Batch conversion over a pool of threads.
+
+	The files are handed out biggest first from a shared counter, so the big scores get started
+	early and the small ones fill in around them at the end, instead of one big file straggling
+	after everything else is done. Each thread converts all its files with one MIDIFile, reset in
+	between, so the output and queue space, and the blocks of its arena, are allocated once per
+	thread and not once per file.
+*/
+
+
+typedef struct batch_job BatchJob;
+struct batch_job {
+
+	MIDIBatchItem 	*items;
+	const MIDIOptions *options;		// for every file, or NULL for the defaults
+	int 			*order;			// item indices, biggest input first, or NULL to go in item order
+	int 			num_items;
+	int 			next;			// the next place in order to hand out
+};
+
+typedef struct batch_size BatchSize;
+struct batch_size {
+
+	uint64_t 		size;
+	int 			ndx;
+};
+
+
+double batch_now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int batch_bigger_first(const void *a, const void *b) {
+
+	uint64_t sa = ((const BatchSize*)a)->size;
+	uint64_t sb = ((const BatchSize*)b)->size;
+	return (sa < sb) - (sa > sb);
+}
+
+void batch_convert(MIDIFile *midi, MIDIBatchItem *item, const MIDIOptions *options) {
+
+	double start = batch_now();
+
+	item->result = -1;
+	item->error = "can't read the MIDI file";
+	item->bytes_in = 0;
+	item->bytes_out = 0;
+
+	midi_reset(midi);
+	if (midi_load_into(midi, item->midifile, MIDI_LOAD_MMAP)) {
+
+		FILE *fout = NULL;
+		item->error = "can't open the output file";
+		if (!item->outfile || (fout = fopen(item->outfile, "wb"))) {
+
+			if (options) midi->options = *options;
+			if (fout) midi_set_sink(midi, midi_write_file, fout, 0);
+			int converted = midi_convert(midi);
+
+			item->bytes_in = midi->data_len;
+			item->bytes_out = midi->output_flushed + midi->output_len;
+			item->result = converted && !midi->sink_error ? 0 : -1;
+			if (!converted) item->error = midi->error ? midi->error : "conversion failed";
+			else if (midi->sink_error) item->error = "can't write the output file";
+			else item->error = NULL;
+			if (fout && fclose(fout) != 0 && item->result == 0) {
+				item->result = -1;
+				item->error = "can't write the output file";
+			}
+		}
+	}
+
+	item->seconds = batch_now() - start;
+}
+
+void *batch_worker(void *arg) {
+
+	BatchJob *job = (BatchJob*)arg;
+	MIDIFile *midi = (MIDIFile*)calloc(sizeof(MIDIFile), 1);
+
+	while (1) {
+		int next = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (next >= job->num_items) break;
+
+		MIDIBatchItem *item = &job->items[job->order ? job->order[next] : next];
+		if (midi) batch_convert(midi, item, job->options);
+		else { // the files this thread takes fail, and the other threads carry on
+			item->result = -1;
+			item->error = "out of memory";
+			item->bytes_in = item->bytes_out = 0;
+			item->seconds = 0;
+		}
+	}
+
+	if (midi) midi_free(midi);
+	return NULL;
+}
+
+
+/// Convert all the items on num_threads threads (0 for one per processor); returns how many failed.
+/// A file fails with "out of memory" if its thread can't get a MIDIFile to convert it with.
+int midi_binarize_batch(MIDIBatchItem *items, int num_items, int num_threads, const MIDIOptions *options,
+                        MIDIBatchStats *stats) {
+
+	double start = batch_now();
+
+	if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads > num_items) num_threads = num_items;
+	if (num_threads < 1) num_threads = 1;
+
+	BatchJob job;
+	job.items = items;
+	job.options = options;
+	job.order = NULL;
+	job.num_items = num_items;
+	job.next = 0;
+
+	// order the work by input size, biggest first; without the memory for it, in item order
+	BatchSize *sizes = (BatchSize*)malloc(sizeof(BatchSize) * (num_items + 1));
+	if (sizes && (job.order = (int*)malloc(sizeof(int) * (num_items + 1)))) {
+		for (int i = 0; i < num_items; ++i) {
+			struct stat st;
+			sizes[i].size = stat(items[i].midifile, &st) == 0 ? (uint64_t)st.st_size : 0;
+			sizes[i].ndx = i;
+		}
+		qsort(sizes, num_items, sizeof(BatchSize), batch_bigger_first);
+		for (int i = 0; i < num_items; ++i) job.order[i] = sizes[i].ndx;
+	}
+	free(sizes);
+
+	// the calling thread is one of the workers, and the only one if there's no memory for the others
+	pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * num_threads);
+	int started = 1;
+	for (; threads && started < num_threads; ++started) {
+		if (pthread_create(&threads[started], NULL, batch_worker, &job) != 0) break;
+	}
+	batch_worker(&job);
+	for (int t = 1; t < started; ++t) pthread_join(threads[t], NULL);
+
+	free(threads);
+	free(job.order);
+
+	MIDIBatchStats total = {0};
+	for (int i = 0; i < num_items; ++i) {
+		++total.files;
+		if (items[i].result != 0) ++total.failed;
+		total.bytes_in += items[i].bytes_in;
+		total.bytes_out += items[i].bytes_out;
+	}
+	total.seconds = batch_now() - start;
+	if (stats) *stats = total;
+
+	return total.failed;
+}
@@ -0,0 +1,831 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "midilib.h"
+
+
+/*
+	Conversion benchmark on synthetic MIDI files.
+
+	Usage: bench merge [max_tracks] [notes_per_track]
+	       bench load [megabytes]
+	       bench trace [notes_per_track]
+	       bench varlen [millions]
+	       bench index [conversions] [notes_per_track]
+	       bench seek [notes_per_track]
+	       bench decode [max_threads] [tracks] [notes_per_track]
+	       bench tonegen [notes_per_track]
+	       bench roundtrip [notes_per_track]
+	       bench suite [notes_per_track]
+	       bench shape [tracks=n] [notes=n] [chord=n] [tempo=n] [pedal=n] [sysex=n] [sysex_len=n] [running=0|1]
+	                   [rest=n]
+	       bench corpus dir [files] [notes_per_track]
+	       bench iterate [notes_per_track]
+
+	merge: for 1, 2, 4, ... up to max_tracks tracks, a type-1 file is generated in which every
+	       track plays notes_per_track notes on a shared beat grid (so many events tie in time),
+	       and its conversion is timed.
+	load:  a file of about the given size is generated, and each midi_load mode is timed up to
+	       the first event of every track, with the private memory and mapped page cache it took.
+	trace: a 16-track file is converted with no trace hook, the ring buffer hook, and the
+	       printing hook (to /dev/null). Build it with "make bench-debug" for the hooks to be
+	       called; in a release build all three are the same, since tracing is compiled out.
+	varlen: millions of delta times of several distributions (chords, grids of 96, 480 and 960
+	       ticks, and any value) are decoded with get_varlen_bytewise and get_varlen, which must
+	       agree, with the numbers per second of each and the speedup.
+	index: a 16-track file is converted the given number of times, with a different channel
+	       mask each time, by parsing the tracks and from an event index built once, with the
+	       time to build it, to convert, and the index's size.
+	seek:  a 16-track file is converted whole, then only a window in the middle and only the
+	       last tenth, with the time each took and its output size.
+	decode: a file of the given number of tracks is decoded into the index on 1, 2, 4, ... up to
+	       max_threads threads, and without an index, with the decode, merge and total times.
+	tonegen: a 16-track file is converted with 1, 2, 4, ... up to MAX_TONEGENS tone generators,
+	       without and with tonegen_per_track, with the time, the generators used and the notes skipped.
+	roundtrip: a 16-track file is converted in both output formats, and each bytestream decoded,
+	       checked against the conversion, and written as an SMF, with the time or MB/s of each step.
+	suite: files of several shapes (see bench_suite_cases) are generated and converted, with the
+	       events and MB per second, the peak RSS, and the time of each stage of the conversion
+	       from a second run with time_stages on, which samples the merge loop. A + after the
+	       peak RSS means it couldn't be reset, and is the peak of the whole run so far.
+	shape: the same for one file, shaped by the arguments: chord is the notes started together,
+	       tempo, pedal and sysex are how many chords apart tempo changes, sustain pedal changes
+	       and sysex events of sysex_len bytes are, running leaves out repeated status bytes, and
+	       rest is how many chords apart the rests of the longest delta time are, which take the
+	       ticks past 32 bits in 17 of them.
+	corpus: files of the suite's shapes, with different seeds, are written to dir, for checking
+	       a new build against the last one with midibatch.
+	iterate: a 16-track file is taken an event at a time with midi_next_event, for the first
+	       msec of it, longer and longer, and all of it, with the time to open and take them and
+	       how much of the track data was parsed for them, against converting it all.
+
+	The tables go to stderr.
+*/
+
+#define BENCH_TICKS_PER_BEAT 480
+#define BENCH_LONG_REST 0x0fffffff 	// the longest delta time there is
+
+
+typedef struct bench_buffer BenchBuffer;
+struct bench_buffer {
+
+	byte 		*data;
+	long 		len;
+	long 		mem;
+};
+
+void bench_put(BenchBuffer *b, byte val) {
+
+	if (b->len == b->mem) {
+		b->mem = b->mem ? 2 * b->mem : 4096;
+		b->data = (byte*)realloc(b->data, b->mem);
+	}
+	b->data[b->len++] = val;
+}
+
+void bench_put_long(BenchBuffer *b, uint32_t val) { // big-endian
+
+	for (int i = 24; i >= 0; i -= 8) bench_put(b, (byte)(val >> i));
+}
+
+void bench_put_varlen(BenchBuffer *b, unsigned long val) {
+
+	byte tmp[4];
+	int n = 0;
+	do {
+		tmp[n++] = val & 0x7f;
+		val >>= 7;
+	} while (val && n < 4);
+
+	while (n > 1) bench_put(b, tmp[--n] | 0x80);
+	bench_put(b, tmp[0]);
+}
+
+
+/// what bench_generate_shape makes
+typedef struct bench_shape BenchShape;
+struct bench_shape {
+
+	int 		tracks;
+	int 		notes;			// per track
+	int 		chord;			// notes started together, for the density
+	int 		tempo_every;	// a tempo change every this many chords of the first track, or 0 for none
+	int 		pedal_every;	// a sustain pedal change every this many chords of each track, or 0
+	int 		sysex_every;	// a sysex of sysex_len bytes every this many chords of each track, or 0
+	int 		sysex_len;
+	bool 		running_status;	// leave out repeated status bytes, with note-ons of volume 0 for the offs
+	int 		rest_every;		// a rest of BENCH_LONG_REST ticks every this many chords of each track, or 0
+};
+
+// the status byte, unless it's the same as the last one and running status is being used
+void bench_put_status(BenchBuffer *b, int *last_status, byte status, bool running_status) {
+
+	if (!running_status || status != *last_status) bench_put(b, status);
+	*last_status = status;
+}
+
+/// Generate a type-1 file of the given shape; returns the number of MIDI events
+long bench_generate_shape(BenchBuffer *b, const BenchShape *shape, unsigned seed) {
+
+	long events = 0;
+	srand(seed);
+
+	b->len = 0;
+	bench_put(b, 'M'); bench_put(b, 'T'); bench_put(b, 'h'); bench_put(b, 'd');
+	bench_put_long(b, 6);
+	bench_put(b, 0); bench_put(b, 1); // format type 1
+	bench_put(b, (byte)(shape->tracks >> 8)); bench_put(b, (byte)shape->tracks);
+	bench_put(b, BENCH_TICKS_PER_BEAT >> 8); bench_put(b, BENCH_TICKS_PER_BEAT & 0xff);
+
+	int chord = shape->chord > 0 ? shape->chord : 1;
+
+	for (int tracknum = 0; tracknum < shape->tracks; ++tracknum) {
+
+		bench_put(b, 'M'); bench_put(b, 'T'); bench_put(b, 'r'); bench_put(b, 'k');
+		long lenpos = b->len;
+		bench_put_long(b, 0); // patched below
+
+		int chan = tracknum % 15;
+		if (chan >= PERCUSSION_TRACK) ++chan;
+		int last_status = -1;
+		int pedal = 0;
+
+		if (tracknum == 0) { // tempo 120 bpm
+			bench_put_varlen(b, 0);
+			bench_put(b, 0xff); bench_put(b, 0x51); bench_put(b, 3);
+			bench_put(b, 0x07); bench_put(b, 0xa1); bench_put(b, 0x20);
+			++events;
+		}
+
+		for (int i = 0; i < shape->notes; i += chord) {
+			int note = 36 + rand() % 48;
+			int gap = (rand() % 4) * BENCH_TICKS_PER_BEAT / 4; // on a sixteenth-note grid
+			int len = (1 + rand() % 4) * BENCH_TICKS_PER_BEAT / 4;
+			int num = i + chord <= shape->notes ? chord : shape->notes - i;
+			int n = i / chord; // which chord
+
+			if (shape->rest_every && n % shape->rest_every == shape->rest_every - 1)
+				gap = BENCH_LONG_REST;
+			if (tracknum == 0 && shape->tempo_every && n % shape->tempo_every == shape->tempo_every - 1) {
+				uint32_t tempo = 300000 + rand() % 700000;
+				bench_put_varlen(b, gap);
+				bench_put(b, 0xff); bench_put(b, 0x51); bench_put(b, 3);
+				bench_put(b, (byte)(tempo >> 16)); bench_put(b, (byte)(tempo >> 8)); bench_put(b, (byte)tempo);
+				last_status = -1; // meta events end the running status
+				gap = 0;
+				++events;
+			}
+			if (shape->sysex_every && n % shape->sysex_every == shape->sysex_every - 1) {
+				bench_put_varlen(b, gap);
+				bench_put(b, 0xf0);
+				bench_put_varlen(b, shape->sysex_len);
+				for (int k = 0; k < shape->sysex_len - 1; ++k) bench_put(b, k & 0x7f);
+				if (shape->sysex_len > 0) bench_put(b, 0xf7);
+				last_status = -1; // and so do sysex events
+				gap = 0;
+				++events;
+			}
+			if (shape->pedal_every && n % shape->pedal_every == shape->pedal_every - 1) {
+				pedal = pedal ? 0 : 127;
+				bench_put_varlen(b, gap);
+				bench_put_status(b, &last_status, 0xb0 | chan, shape->running_status);
+				bench_put(b, 64); bench_put(b, pedal);
+				gap = 0;
+				++events;
+			}
+
+			for (int k = 0; k < num; ++k) { // the chord's notes are a third or so apart
+				bench_put_varlen(b, k == 0 ? gap : 0);
+				bench_put_status(b, &last_status, 0x90 | chan, shape->running_status);
+				bench_put(b, 36 + (note - 36 + 4 * k) % 48); bench_put(b, 64 + rand() % 64);
+			}
+			for (int k = 0; k < num; ++k) {
+				bench_put_varlen(b, k == 0 ? len : 0);
+				bench_put_status(b, &last_status, (shape->running_status ? 0x90 : 0x80) | chan, shape->running_status);
+				bench_put(b, 36 + (note - 36 + 4 * k) % 48); bench_put(b, 0);
+			}
+			events += 2 * num;
+		}
+
+		bench_put_varlen(b, 0); // end of track
+		bench_put(b, 0xff); bench_put(b, 0x2f); bench_put(b, 0);
+
+		uint32_t tracklen = b->len - lenpos - 4;
+		for (int i = 0; i < 4; ++i) b->data[lenpos + i] = (byte)(tracklen >> (24 - 8 * i));
+	}
+
+	return events;
+}
+
+/// Generate a type-1 file with num_tracks tracks of num_notes notes each; returns the number of MIDI events
+long bench_generate(BenchBuffer *b, int num_tracks, int num_notes, unsigned seed) {
+
+	BenchShape shape = {0};
+	shape.tracks = num_tracks;
+	shape.notes = num_notes;
+	shape.chord = 1;
+	return bench_generate_shape(b, &shape, seed);
+}
+
+double bench_now(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int bench_write(BenchBuffer *b, const char *path) {
+
+	FILE *f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return False;
+	}
+	fwrite(b->data, 1, b->len, f);
+	fclose(f);
+	return True;
+}
+
+/// Get one of the "Rss..." or "Vm..." lines of /proc/self/status, in KB
+long bench_rss_kb(const char *field) {
+
+	char line[256];
+	long kb = 0;
+	size_t len = strlen(field);
+
+	FILE *f = fopen("/proc/self/status", "r");
+	if (!f) return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			kb = atol(line + len + 1);
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+
+int bench_merge(const char *midipath, int max_tracks, int num_notes) {
+
+	BenchBuffer b = {0};
+
+	if (max_tracks >= MAX_TRACKS) max_tracks = MAX_TRACKS - 1;
+
+	fprintf(stderr, "%8s %12s %12s %14s %12s %10s %10s %10s\n",
+	        "tracks", "events", "sec", "events/sec", "out bytes", "reallocs", "queue max", "old delays");
+	for (int num_tracks = 1; num_tracks <= max_tracks; num_tracks *= 2) {
+
+		long events = bench_generate(&b, num_tracks, num_notes, 1234);
+		if (!bench_write(&b, midipath)) return 1;
+
+		double start = bench_now();
+		MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+		midi_convert(midi);
+		double elapsed = bench_now() - start;
+
+		fprintf(stderr, "%8d %12ld %12.4f %14.0f %12u %10u %10d %10d\n", num_tracks, events, elapsed, events / elapsed,
+		        midi->output_len, midi->output_reallocs, midi->queue_highwater, midi->events_would_delay);
+		midi_free(midi);
+	}
+
+	free(b.data);
+	return 0;
+}
+
+int bench_load(const char *midipath, int megabytes) {
+
+	BenchBuffer b = {0};
+	const int num_tracks = 16;
+	const char *modename[] = { "read", "mmap" };
+
+	// each note is about 8 bytes of track data
+	bench_generate(&b, num_tracks, megabytes * (1 << 20) / 8 / num_tracks, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	fprintf(stderr, "%.1f MB file\n", b.len / (double)(1 << 20));
+	fprintf(stderr, "%8s %18s %18s %18s\n", "mode", "first event usec", "private KB", "page cache KB");
+	for (int mode = MIDI_LOAD_READ; mode <= MIDI_LOAD_MMAP; ++mode) {
+
+		long anon_before = bench_rss_kb("RssAnon");
+		long file_before = bench_rss_kb("RssFile");
+		double start = bench_now();
+
+		MIDIFile *midi = midi_load(midipath, mode);
+		midi_process_file_header(midi);
+		for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
+			midi_process_track_header(midi, tracknum);
+			midi_find_next_note(midi, tracknum);
+		}
+
+		double elapsed = bench_now() - start;
+		long anon = bench_rss_kb("RssAnon") - anon_before;
+		long file = bench_rss_kb("RssFile") - file_before;
+		midi_free(midi);
+
+		fprintf(stderr, "%8s %18.1f %18ld %18ld\n", modename[mode], elapsed * 1e6, anon, file);
+	}
+	return 0;
+}
+
+
+int bench_trace(const char *midipath, int num_notes) {
+
+	BenchBuffer b = {0};
+	const char *hookname[] = { "off", "ring", "print" };
+
+	long events = bench_generate(&b, 16, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	MIDITraceRing ring;
+	midi_trace_ring_init(&ring, 1 << 16);
+	FILE *devnull = fopen("/dev/null", "w");
+
+	#ifdef DEBUG
+	fprintf(stderr, "tracing compiled in\n");
+	#else
+	fprintf(stderr, "tracing compiled out\n");
+	#endif
+	fprintf(stderr, "%8s %12s %14s %14s\n", "hook", "sec", "events/sec", "traced");
+	for (int hook = 0; hook < 3; ++hook) {
+
+		ring.count = 0;
+		double start = bench_now();
+
+		MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+		if (hook == 1) midi_set_trace(midi, midi_trace_to_ring, &ring);
+		if (hook == 2) midi_set_trace(midi, midi_trace_to_file, devnull);
+		midi_convert(midi);
+		midi_free(midi);
+
+		double elapsed = bench_now() - start;
+		fprintf(stderr, "%8s %12.4f %14.0f %14lu\n", hookname[hook], elapsed, events / elapsed, (unsigned long)ring.count);
+	}
+
+	fclose(devnull);
+	midi_trace_ring_free(&ring);
+	return 0;
+}
+
+
+int bench_varlen(int millions) {
+
+	const char *distname[] = { "chords", "grid 96", "grid 480", "grid 960", "any" };
+	const int num_dists = 5;
+	const long count = millions * 1000000L;
+	BenchBuffer b = {0};
+
+	fprintf(stderr, "%10s %12s %16s %16s %8s\n", "deltas", "bytes/num", "bytewise num/s", "get_varlen num/s", "speedup");
+	for (int dist = 0; dist < num_dists; ++dist) {
+
+		// delta times as they come in tracks: mostly zero within chords, or steps on a grid
+		srand(1234);
+		b.len = 0;
+		for (long i = 0; i < count; ++i) {
+			int r = rand();
+			unsigned long delta;
+			switch (dist) {
+			case 0: delta = r % 4 ? 0 : 1 + r % 100; break;
+			case 1: delta = (r % 8) * 96 / 4; break;
+			case 2: delta = (r % 8) * 480 / 4; break;
+			case 3: delta = (r % 8) * 960 / 4; break;
+			default: delta = r & 0x0fffffff; break;
+			}
+			bench_put_varlen(&b, delta);
+		}
+
+		double elapsed[2];
+		unsigned long sum[2];
+		for (int decoder = 0; decoder < 2; ++decoder) {
+			uint8_t *ptr = b.data, *end = b.data + b.len;
+			sum[decoder] = 0;
+			double start = bench_now();
+			if (decoder == 0)
+				while (ptr < end) sum[decoder] += get_varlen_bytewise(&ptr, end);
+			else
+				while (ptr < end) sum[decoder] += get_varlen(&ptr, end);
+			elapsed[decoder] = bench_now() - start;
+		}
+		if (sum[0] != sum[1]) {
+			fprintf(stderr, "%s: the decoders disagree\n", distname[dist]);
+			return 1;
+		}
+
+		fprintf(stderr, "%10s %12.2f %16.0f %16.0f %8.2f\n", distname[dist], b.len / (double)count,
+		        count / elapsed[0], count / elapsed[1], elapsed[0] / elapsed[1]);
+	}
+
+	free(b.data);
+	return 0;
+}
+
+
+int bench_index(const char *midipath, int conversions, int num_notes) {
+
+	BenchBuffer b = {0};
+
+	long events = bench_generate(&b, 16, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	fprintf(stderr, "%8s %12s %12s %14s %14s\n", "source", "build sec", "convert sec", "events/sec", "index bytes");
+	for (int indexed = 0; indexed < 2; ++indexed) {
+
+		MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+		double start = bench_now();
+		if (indexed) midi_build_index(midi);
+		double built = bench_now();
+
+		for (int i = 0; i < conversions; ++i) {
+			midi->options.channel_mask = 0xffff >> (i % 16); // a different selection each time
+			midi_convert(midi);
+		}
+		double done = bench_now();
+
+		long index_bytes = indexed ? (long)midi->index->num_events * (sizeof(uint64_t) + sizeof(uint32_t) + 3) : 0;
+		fprintf(stderr, "%8s %12.4f %12.4f %14.0f %14ld\n", indexed ? "index" : "parse", built - start,
+		        done - built, events * conversions / (done - start), index_bytes);
+		midi_free(midi);
+	}
+	return 0;
+}
+
+
+int bench_seek(const char *midipath, int num_notes) {
+
+	BenchBuffer b = {0};
+	const char *windowname[] = { "all", "middle", "end" };
+
+	bench_generate(&b, 16, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+	midi_build_tempo_map(midi);
+	midi_convert(midi);
+	uint64_t length_usec = midi->timenow_usec;
+
+	fprintf(stderr, "%8s %12s %12s %12s\n", "window", "start sec", "sec", "out bytes");
+	for (int window = 0; window < 3; ++window) {
+
+		midi->options.start_usec = window == 0 ? 0 : window == 1 ? length_usec / 2 : length_usec / 10 * 9;
+		midi->options.end_usec = window == 1 ? length_usec / 10 * 6 : 0;
+
+		double start = bench_now();
+		midi_convert(midi);
+		double elapsed = bench_now() - start;
+
+		fprintf(stderr, "%8s %12.1f %12.4f %12u\n", windowname[window], midi->options.start_usec / 1e6, elapsed,
+		        midi->output_len);
+	}
+
+	midi_free(midi);
+	return 0;
+}
+
+
+int bench_decode(const char *midipath, int max_threads, int num_tracks, int num_notes) {
+
+	BenchBuffer b = {0};
+
+	if (num_tracks >= MAX_TRACKS) num_tracks = MAX_TRACKS - 1;
+	long events = bench_generate(&b, num_tracks, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	fprintf(stderr, "%d tracks, %ld events\n", num_tracks, events);
+	fprintf(stderr, "%8s %12s %12s %12s %14s\n", "threads", "decode sec", "merge sec", "total sec", "events/sec");
+	for (int threads = 0; threads <= max_threads; threads = threads ? 2 * threads : 1) {
+
+		MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+		double start = bench_now();
+		if (threads) midi_build_index_threads(midi, threads);
+		double decoded = bench_now();
+		midi_convert(midi);
+		double done = bench_now();
+		midi_free(midi);
+
+		if (threads) fprintf(stderr, "%8d %12.4f", threads, decoded - start);
+		else fprintf(stderr, "%8s %12s", "none", "-");
+		fprintf(stderr, " %12.4f %12.4f %14.0f\n", done - decoded, done - start, events / (done - start));
+	}
+	return 0;
+}
+
+
+int bench_tonegen(const char *midipath, int num_notes) {
+
+	BenchBuffer b = {0};
+
+	long events = bench_generate(&b, 16, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+	fprintf(stderr, "%8s %10s %12s %14s %8s %8s\n", "tonegens", "per track", "sec", "events/sec", "used", "skipped");
+	for (int per_track = 0; per_track <= 1; ++per_track) {
+		for (int tonegens = 0; tonegens <= MAX_TONEGENS; tonegens = tonegens ? 2 * tonegens : 1) {
+			if (per_track && !tonegens) continue;
+
+			midi->options.num_tonegens = tonegens;
+			midi->options.tonegen_per_track = per_track;
+			double start = bench_now();
+			midi_convert(midi);
+			double elapsed = bench_now() - start;
+
+			fprintf(stderr, "%8d %10s %12.4f %14.0f %8d %8d\n", tonegens, per_track ? "yes" : "no", elapsed,
+			        events / elapsed, midi->tonegens_used, midi->notes_skipped);
+		}
+	}
+
+	midi_free(midi);
+	return 0;
+}
+
+
+int bench_roundtrip(const char *midipath, int num_notes) {
+
+	BenchBuffer b = {0};
+
+	bench_generate(&b, 16, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+	fprintf(stderr, "%8s %10s %12s %12s %12s %12s %8s\n", "format", "bytes", "convert sec", "decode MB/s", "check MB/s", "smf sec", "ok");
+	for (int format = MIDI_FORMAT_CLASSIC; format <= MIDI_FORMAT_COMPACT; ++format) {
+
+		midi->options.output_format = format;
+		double start = bench_now();
+		midi_convert(midi);
+		double converted = bench_now();
+
+		MIDIStream stream = {0};
+		stream.expect_format = format;
+		if (!midi_decode_stream(&stream, midi->output, midi->output_len)) {
+			fprintf(stderr, "decode: %s\n", stream.error);
+			return 1;
+		}
+		double decoded = bench_now();
+
+		MIDIRoundTrip check;
+		int ok = midi_check_roundtrip(midi, &stream, &check);
+		double checked = bench_now();
+
+		byte *smf;
+		size_t smf_len;
+		midi_stream_to_smf(&stream, &smf, &smf_len);
+		double emitted = bench_now();
+
+		fprintf(stderr, "%8s %10lu %12.4f %12.1f %12.1f %12.4f %8s\n", format == MIDI_FORMAT_COMPACT ? "compact" : "classic",
+		        (unsigned long)midi->output_len, converted - start, midi->output_len / (decoded - converted) / 1e6,
+		        midi->output_len / (checked - decoded) / 1e6, emitted - checked, ok ? "yes" : "no");
+		free(smf);
+		midi_stream_free(&stream);
+	}
+
+	midi_free(midi);
+	return 0;
+}
+
+
+// the part of the track data the merge has parsed so far
+double bench_parsed(MIDIFile *midi) {
+
+	long left = 0;
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum)
+		left += midi->track[tracknum].trkend - midi->track[tracknum].trkptr;
+	return 1.0 - (double)left / midi->tracks_len;
+}
+
+int bench_iterate(const char *midipath, int num_notes) {
+
+	BenchBuffer b = {0};
+
+	bench_generate(&b, 16, num_notes, 1234);
+	if (!bench_write(&b, midipath)) return 1;
+	free(b.data);
+
+	MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+	double start = bench_now();
+	midi_convert(midi);
+	double convert_sec = bench_now() - start;
+	uint64_t length_usec = midi->timenow_usec;
+
+	fprintf(stderr, "%12s %10s %12s %10s\n", "first msec", "events", "sec", "parsed");
+	for (uint64_t msec = 100; ; msec *= 10) {
+
+		bool all = msec * 1000 >= length_usec;
+		MIDIEvent event;
+		long events = 0;
+
+		start = bench_now();
+		midi_open(midi);
+		while (midi_next_event(midi, &event) && (all || event.time_usec < msec * 1000)) ++events;
+		double elapsed = bench_now() - start;
+
+		if (all) fprintf(stderr, "%12s", "all");
+		else fprintf(stderr, "%12lu", (unsigned long)msec);
+		fprintf(stderr, " %10ld %12.6f %9.1f%%\n", events, elapsed, 100 * bench_parsed(midi));
+		midi_close(midi);
+		if (all) break;
+	}
+	fprintf(stderr, "%12s %10u %12.6f %9.1f%%\n", "convert", midi->commands_output, convert_sec, 100.0);
+
+	midi_free(midi);
+	return 0;
+}
+
+
+/// Start the peak RSS (VmHWM) over from the current RSS; returns False where the kernel can't
+int bench_reset_peak_rss(void) {
+
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (!f) return False;
+	int ok = fputs("5", f) >= 0;
+	return fclose(f) == 0 && ok;
+}
+
+typedef struct bench_case BenchCase;
+struct bench_case {
+
+	const char 	*name;
+	BenchShape 	shape;			// with notes filled in from the command line
+};
+
+// tracks, notes, chord, tempo_every, pedal_every, sysex_every, sysex_len, running_status, rest_every
+const BenchCase bench_suite_cases[] = {
+	{ "plain",   { 16, 0, 1, 0, 0, 0, 0, false } },
+	{ "sparse",  {  2, 0, 1, 0, 0, 0, 0, false } },
+	{ "dense",   { 16, 0, 6, 0, 0, 0, 0, false } },
+	{ "tracks",  { MAX_TRACKS - 1, 0, 1, 0, 0, 0, 0, false } },
+	{ "tempo",   { 16, 0, 1, 2, 0, 0, 0, false } },
+	{ "pedals",  { 16, 0, 1, 0, 1, 0, 0, false } },
+	{ "sysex",   { 16, 0, 1, 0, 0, 8, 512, false } },
+	{ "running", { 16, 0, 1, 0, 0, 0, 0, true } },
+	{ "mixed",   { 32, 0, 3, 8, 4, 32, 64, true } },
+	{ "rests",   {  2, 0, 1, 0, 0, 0, 0, false, 25 } },
+};
+#define BENCH_SUITE_CASES (int)(sizeof(bench_suite_cases) / sizeof(bench_suite_cases[0]))
+
+void bench_case_header(void) {
+
+	fprintf(stderr, "%8s %10s %8s %8s %8s %14s %8s %9s %8s %8s %8s %8s\n", "shape", "events", "MB", "load ms",
+	        "conv ms", "events/sec", "MB/sec", "peak MB", "hdr ms", "merge ms", "queue ms", "out ms");
+}
+
+/// Generate a file of the shape and time its conversion, once as it is and once with the stages timed
+int bench_case(const char *midipath, const char *name, const BenchShape *shape, unsigned seed) {
+
+	BenchBuffer b = {0};
+
+	long events = bench_generate_shape(&b, shape, seed);
+	if (!bench_write(&b, midipath)) return 1;
+	double megabytes = b.len / 1e6;
+	free(b.data);
+
+	int peak_reset = bench_reset_peak_rss();
+	double start = bench_now();
+	MIDIFile *midi = midi_load(midipath, MIDI_LOAD_MMAP);
+	double loaded = bench_now();
+	if (!midi_convert(midi)) {
+		fprintf(stderr, "%s: %s\n", name, midi->error);
+		midi_free(midi);
+		return 1;
+	}
+	double converted = bench_now();
+	long peak_kb = bench_rss_kb("VmHWM");
+
+	midi->time_stages = true;
+	midi_convert(midi);
+
+	fprintf(stderr, "%8s %10ld %8.2f %8.2f %8.2f %14.0f %8.1f %8.1f%s", name, events, megabytes,
+	        (loaded - start) * 1e3, (converted - loaded) * 1e3, events / (converted - loaded),
+	        megabytes / (converted - loaded), peak_kb / 1024.0, peak_reset ? " " : "+");
+	for (int stage = 0; stage < NUM_STAGES; ++stage)
+		fprintf(stderr, " %8.2f", midi->stage_nsec[stage] / 1e6);
+	fprintf(stderr, "\n");
+
+	midi_free(midi);
+	return 0;
+}
+
+int bench_suite(const char *midipath, int num_notes) {
+
+	bench_case_header();
+	for (int c = 0; c < BENCH_SUITE_CASES; ++c) {
+		BenchShape shape = bench_suite_cases[c].shape;
+		shape.notes = num_notes;
+		if (bench_case(midipath, bench_suite_cases[c].name, &shape, 1234)) return 1;
+	}
+	return 0;
+}
+
+/// "bench shape" arguments, as name=value; returns False for one it doesn't know
+int bench_parse_shape(BenchShape *shape, int argc, char *argv[]) {
+
+	for (int a = 0; a < argc; ++a) {
+		const char *eq = strchr(argv[a], '=');
+		if (!eq) return False;
+		size_t len = eq - argv[a];
+		int value = atoi(eq + 1);
+
+		if (strncmp(argv[a], "tracks", len) == 0) shape->tracks = value;
+		else if (strncmp(argv[a], "notes", len) == 0) shape->notes = value;
+		else if (strncmp(argv[a], "chord", len) == 0) shape->chord = value;
+		else if (strncmp(argv[a], "tempo", len) == 0) shape->tempo_every = value;
+		else if (strncmp(argv[a], "pedal", len) == 0) shape->pedal_every = value;
+		else if (strncmp(argv[a], "sysex", len) == 0) shape->sysex_every = value;
+		else if (strncmp(argv[a], "sysex_len", len) == 0) shape->sysex_len = value;
+		else if (strncmp(argv[a], "running", len) == 0) shape->running_status = value != 0;
+		else if (strncmp(argv[a], "rest", len) == 0) shape->rest_every = value;
+		else return False;
+	}
+	if (shape->tracks >= MAX_TRACKS) shape->tracks = MAX_TRACKS - 1;
+	return True;
+}
+
+/// Write num_files files of the suite's shapes, with different seeds, into dir
+int bench_corpus(const char *dir, int num_files, int num_notes) {
+
+	BenchBuffer b = {0};
+	char path[1024];
+	long bytes = 0;
+
+	mkdir(dir, 0777); // if it isn't there already
+	for (int f = 0; f < num_files; ++f) {
+		const BenchCase *c = &bench_suite_cases[f % BENCH_SUITE_CASES];
+		BenchShape shape = c->shape;
+		shape.notes = num_notes;
+		bench_generate_shape(&b, &shape, 1000 + f);
+
+		snprintf(path, sizeof(path), "%s/%s_%d.mid", dir, c->name, f);
+		if (!bench_write(&b, path)) return 1;
+		bytes += b.len;
+	}
+
+	free(b.data);
+	fprintf(stderr, "%d files, %.1f MB in %s\n", num_files, bytes / 1e6, dir);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	const char *midipath = "bench_input.mid";
+	const char *what = argc > 1 ? argv[1] : "merge";
+	int result;
+
+	if (strcmp(what, "merge") == 0)
+		result = bench_merge(midipath, argc > 2 ? atoi(argv[2]) : 64, argc > 3 ? atoi(argv[3]) : 5000);
+	else if (strcmp(what, "load") == 0)
+		result = bench_load(midipath, argc > 2 ? atoi(argv[2]) : 16);
+	else if (strcmp(what, "trace") == 0)
+		result = bench_trace(midipath, argc > 2 ? atoi(argv[2]) : 5000);
+	else if (strcmp(what, "varlen") == 0)
+		result = bench_varlen(argc > 2 ? atoi(argv[2]) : 20);
+	else if (strcmp(what, "index") == 0)
+		result = bench_index(midipath, argc > 2 ? atoi(argv[2]) : 16, argc > 3 ? atoi(argv[3]) : 5000);
+	else if (strcmp(what, "seek") == 0)
+		result = bench_seek(midipath, argc > 2 ? atoi(argv[2]) : 5000);
+	else if (strcmp(what, "decode") == 0)
+		result = bench_decode(midipath, argc > 2 ? atoi(argv[2]) : 8, argc > 3 ? atoi(argv[3]) : 32,
+		                      argc > 4 ? atoi(argv[4]) : 5000);
+	else if (strcmp(what, "tonegen") == 0)
+		result = bench_tonegen(midipath, argc > 2 ? atoi(argv[2]) : 5000);
+	else if (strcmp(what, "roundtrip") == 0)
+		result = bench_roundtrip(midipath, argc > 2 ? atoi(argv[2]) : 5000);
+	else if (strcmp(what, "suite") == 0)
+		result = bench_suite(midipath, argc > 2 ? atoi(argv[2]) : 5000);
+	else if (strcmp(what, "shape") == 0) {
+		BenchShape shape = { 16, 5000, 1, 0, 0, 0, 0, false };
+		if (!bench_parse_shape(&shape, argc - 2, argv + 2)) {
+			fprintf(stderr, "shape: tracks= notes= chord= tempo= pedal= sysex= sysex_len= running=\n");
+			return 1;
+		}
+		bench_case_header();
+		result = bench_case(midipath, "shape", &shape, 1234);
+	}
+	else if (strcmp(what, "iterate") == 0)
+		result = bench_iterate(midipath, argc > 2 ? atoi(argv[2]) : 5000);
+	else if (strcmp(what, "corpus") == 0 && argc > 2)
+		return bench_corpus(argv[2], argc > 3 ? atoi(argv[3]) : 100, argc > 4 ? atoi(argv[4]) : 2000);
+	else {
+		fprintf(stderr, "usage: bench merge [max_tracks] [notes_per_track] | bench load [megabytes] | bench trace [notes_per_track]\n"
+		                "       bench varlen [millions] | bench index [conversions] [notes_per_track] | bench seek [notes_per_track]\n"
+		                "       bench decode [max_threads] [tracks] [notes_per_track] | bench tonegen [notes_per_track]\n"
+		                "       bench roundtrip [notes_per_track] | bench suite [notes_per_track]\n"
+		                "       bench shape [name=value ...] | bench corpus dir [files] [notes_per_track]\n"
+		                "       bench iterate [notes_per_track]\n");
+		return 1;
+	}
+
+	remove(midipath);
+	return result;
+}
@@ -0,0 +1,585 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "midilib.h"
+
+
+/*
+	Reading the bytestream back.
+
+	midi_decode_stream parses a bytestream, in the output format the caller expects, into timed
+	events, and midi_stream_to_smf writes those out again as a Standard MIDI File, at 1000 ticks
+	per beat and a beat a second, so a tick is the msec of the delays. Each tone generator gets
+	its own MIDI channel.
+
+	A classic stream has no header, and one whose first delay is 0x5074 msec starts with "Pt"
+	just as a compact one does, so the format isn't guessed from that: the caller says which it
+	is. MIDI_FORMAT_DETECT, for streams of unknown origin, only takes a header that is all there,
+	of the right length and for the compact format.
+
+	midi_check_roundtrip compares a decoded bytestream with the score it came from. It works the
+	score out on its own, from the event index and the tempo map rather than by converting it
+	again: every note start, stop and pedal change of the wanted channels, at its time in usec,
+	with the stops moved earlier for the release as midi_convert does. It is one pass along the
+	decoded events, which are in time order: the tracks of the index are merged along with them,
+	through a heap as the conversion merges them, only as far as the decoded event could need,
+	and what is read waits in a short list for what the event is (command and note, or pedal and
+	value) until a decoded event matches it or it runs out. The delays add up to the time of each
+	command rounded down to the msec, so a matched pair is less than a msec apart. It is for
+	streams of the whole score, made without tone generators, which leave out the notes they skip.
+*/
+
+
+/// Parse a bytestream into stream->events; returns False, with the reason in stream->error, if it is broken
+int midi_decode_stream(MIDIStream *stream, const byte *data, size_t len) {
+
+	const byte *ptr = data, *end = data + len;
+
+	stream->num_events = 0;
+	stream->length_msec = 0;
+	stream->format = stream->expect_format;
+	stream->num_tgens = 1;
+	stream->error = NULL;
+
+	bool header = len >= sizeof(MIDIOutputHeader) && data[0] == 'P' && data[1] == 't'
+	              && data[offsetof(MIDIOutputHeader, hdr_length)] == sizeof(MIDIOutputHeader)
+	              && data[offsetof(MIDIOutputHeader, format)] == MIDI_FORMAT_COMPACT;
+	if (stream->format == MIDI_FORMAT_DETECT)
+		stream->format = header ? MIDI_FORMAT_COMPACT : MIDI_FORMAT_CLASSIC;
+
+	if (stream->format == MIDI_FORMAT_COMPACT) {
+		if (!header) {
+			stream->error = "no compact format header";
+			return False;
+		}
+		stream->num_tgens = data[offsetof(MIDIOutputHeader, num_tgens)];
+		ptr += sizeof(MIDIOutputHeader);
+	}
+	else if (stream->format != MIDI_FORMAT_CLASSIC) {
+		stream->error = "unknown output format";
+		return False;
+	}
+	bool compact = stream->format == MIDI_FORMAT_COMPACT;
+
+	// every event takes at least two bytes, so this is enough space
+	uint32_t most = (uint32_t)(len / 2 + 1);
+	if (stream->events_mem < most) {
+		free(stream->events);
+		stream->events = (MIDIStreamEvent*)malloc(sizeof(MIDIStreamEvent) * most);
+		stream->events_mem = most;
+	}
+
+	MIDIStreamEvent *ev = stream->events;
+	uint64_t msec = 0;
+
+	while (ptr < end) {
+
+		byte cmd = *ptr;
+
+		if (cmd < 0x80) { // a delay
+			if (compact && (cmd & DELAY_SHORT)) {
+				msec += cmd & DELAY_SHORT_MAX;
+				ptr += 1;
+				continue;
+			}
+			if (end - ptr < 2) break;
+			msec += (cmd << 8) | ptr[1];
+			ptr += 2;
+			continue;
+		}
+
+		switch (cmd & 0xf0) {
+
+		case CMD_PLAYNOTE:
+			if (end - ptr < 3) goto truncated;
+			ev->value = ptr[2];
+			// fall through
+		case CMD_STOPNOTE:
+		case CMD_INSTRUMENT:
+			if (end - ptr < 2) goto truncated;
+			ev->time_msec = msec;
+			ev->cmd = cmd & 0xf0;
+			ev->tonegen = cmd & 0x0f;
+			ev->note = ptr[1];
+			if (ev->cmd != CMD_PLAYNOTE) ev->value = 0;
+			ptr += ev->cmd == CMD_PLAYNOTE ? 3 : 2;
+			++ev;
+			break;
+
+		case CMD_PED0:
+		case CMD_PED1:
+		case CMD_PED2:
+			if (end - ptr < 2) goto truncated;
+			ev->time_msec = msec;
+			ev->cmd = cmd & 0xf0;
+			ev->tonegen = 0;
+			ev->note = 0;
+			ev->value = ptr[1];
+			ptr += 2;
+			++ev;
+			break;
+
+		case CMD_STOP:
+		case CMD_RESTART:
+			stream->num_events = ev - stream->events;
+			stream->length_msec = msec;
+			if (ptr + 1 != end) {
+				stream->error = "data after the end of the score";
+				return False;
+			}
+			return True;
+
+		default:
+			stream->num_events = ev - stream->events;
+			stream->error = "unknown command";
+			return False;
+		}
+	}
+
+truncated:
+	stream->num_events = ev - stream->events;
+	stream->error = ptr < end ? "the last command is cut off" : "no CMD_STOP at the end";
+	return False;
+}
+
+void midi_stream_free(MIDIStream *stream) {
+
+	free(stream->events);
+	stream->events = NULL;
+	stream->num_events = stream->events_mem = 0;
+}
+
+
+byte *smf_put_varlen(byte *ptr, uint32_t val) {
+
+	if (val >= 1u << 21) *ptr++ = 0x80 | ((val >> 21) & 0x7f);
+	if (val >= 1u << 14) *ptr++ = 0x80 | ((val >> 14) & 0x7f);
+	if (val >= 1u << 7) *ptr++ = 0x80 | ((val >> 7) & 0x7f);
+	*ptr++ = val & 0x7f;
+	return ptr;
+}
+
+// a delta time, after as many no-op controller changes as it takes to hold a longer one over
+byte *smf_put_delta(byte *ptr, uint64_t delta) {
+
+	while (delta > SMF_MAX_DELTA) {
+		ptr = smf_put_varlen(ptr, SMF_MAX_DELTA);
+		*ptr++ = 0xb0; *ptr++ = 0x6e; *ptr++ = 0; // controller 110 is undefined
+		delta -= SMF_MAX_DELTA;
+	}
+	return smf_put_varlen(ptr, (uint32_t)delta);
+}
+
+byte *smf_put_long(byte *ptr, uint32_t val) { // big-endian
+
+	for (int i = 24; i >= 0; i -= 8) *ptr++ = (byte)(val >> i);
+	return ptr;
+}
+
+/// Write the decoded events as a type 0 Standard MIDI File, in space malloc'd for *smf
+int midi_stream_to_smf(const MIDIStream *stream, byte **smf, size_t *smf_len) {
+
+	// a delta time of up to 4 bytes, and a command of up to 3, for each event and for the
+	// padding needed between events more than the longest delta time apart
+	uint64_t gaps = stream->length_msec / SMF_MAX_DELTA + 2;
+	size_t most = 64 + 7 * (stream->num_events + gaps);
+	byte *out = (byte*)malloc(most);
+	if (!out) return False;
+
+	byte *ptr = out;
+	memcpy(ptr, "MThd", 4);
+	ptr = smf_put_long(ptr + 4, 6);
+	*ptr++ = 0; *ptr++ = 0; // format type 0
+	*ptr++ = 0; *ptr++ = 1; // one track
+	*ptr++ = SMF_TICKS_PER_BEAT >> 8; *ptr++ = SMF_TICKS_PER_BEAT & 0xff;
+
+	memcpy(ptr, "MTrk", 4);
+	byte *track_len = ptr + 4; // filled in at the end
+	ptr += 8;
+	byte *track_start = ptr;
+
+	*ptr++ = 0; // a beat a second, so a tick is a msec
+	*ptr++ = 0xff; *ptr++ = 0x51; *ptr++ = 3;
+	*ptr++ = (SMF_TEMPO >> 16) & 0xff; *ptr++ = (SMF_TEMPO >> 8) & 0xff; *ptr++ = SMF_TEMPO & 0xff;
+
+	uint64_t last = 0;
+	for (uint32_t e = 0; e < stream->num_events; ++e) {
+
+		const MIDIStreamEvent *ev = &stream->events[e];
+		ptr = smf_put_delta(ptr, ev->time_msec - last);
+		last = ev->time_msec;
+
+		switch (ev->cmd) {
+		case CMD_PLAYNOTE:
+			*ptr++ = 0x90 | ev->tonegen; *ptr++ = ev->note & 0x7f; *ptr++ = ev->value & 0x7f;
+			break;
+		case CMD_STOPNOTE:
+			*ptr++ = 0x80 | ev->tonegen; *ptr++ = ev->note & 0x7f; *ptr++ = 0;
+			break;
+		case CMD_INSTRUMENT:
+			*ptr++ = 0xc0 | ev->tonegen; *ptr++ = ev->note & 0x7f;
+			break;
+		default: // the pedals
+			*ptr++ = 0xb0;
+			*ptr++ = ev->cmd == CMD_PED0 ? 64 : ev->cmd == CMD_PED1 ? 66 : 67;
+			*ptr++ = ev->value & 0x7f;
+		}
+	}
+
+	ptr = smf_put_delta(ptr, stream->length_msec - last);
+	*ptr++ = 0xff; *ptr++ = 0x2f; *ptr++ = 0; // end of track
+
+	smf_put_long(track_len, (uint32_t)(ptr - track_start));
+	*smf = out;
+	*smf_len = ptr - out;
+	return True;
+}
+
+
+// events are matched within buckets of the same command and note, or pedal and value
+#define ROUNDTRIP_BUCKETS (5 * 128)
+
+typedef struct roundtrip_event RoundTripEvent;
+struct roundtrip_event {
+
+	uint64_t 	usec;					// the latest it may be output
+	uint32_t 	slack_usec;				// and how much earlier than that it may be
+	int 		next;					// the next one waiting in its bucket, or in the free list; -1 for none
+};
+
+// which kind of bucket a command's events go in, by its high nibble: -1 for none
+const signed char roundtrip_kind[16] = { -1, -1, -1, -1, -1, -1, -1, -1, 1, 0, 2, 3, -1, 4, -1, -1 };
+
+// the bucket of an event with a note (for notes) and value (for pedals)
+int roundtrip_bucket(byte cmd, int note, int value) {
+
+	int kind = roundtrip_kind[cmd >> 4];
+	return kind * 128 + ((kind < 2 ? note : value) & 0x7f);
+}
+
+// the earliest an event may be output
+uint64_t roundtrip_earliest(const RoundTripEvent *event) {
+
+	return event->usec - event->slack_usec;
+}
+
+// the bucket of a decoded event, or -1 for one that isn't checked
+int roundtrip_stream_bucket(const MIDIStreamEvent *event) {
+
+	if (event->cmd == CMD_INSTRUMENT) return -1;
+	return roundtrip_bucket(event->cmd, event->note, event->value);
+}
+
+// the score's events, as the conversion should output them
+typedef struct roundtrip_note RoundTripNote;
+struct roundtrip_note {
+
+	int 		note;
+	uint64_t 	start_usec;				// the earliest it may have started
+	uint64_t 	latest_usec;			// and the latest
+};
+
+// how far along its events the score has been read on a track
+typedef struct roundtrip_track RoundTripTrack;
+struct roundtrip_track {
+
+	int 		event;					// the next one to be checked, in the index
+	uint64_t 	usec;					// its time, or UINT64_MAX if there are no more
+	int 		change;					// the last tempo change at or before it
+	RoundTripNote *sounding; 			// the notes playing on the track so far, to work out the release
+	int 		num_sounding;
+	int 		sounding_mem;
+};
+
+// when a track's next event is
+typedef struct roundtrip_due RoundTripDue;
+struct roundtrip_due {
+
+	uint64_t 	usec;
+	int 		tracknum;
+};
+
+// the score's events that have been read and not yet matched, in a list for each bucket; the
+// space of the matched ones is reused, so there is only ever as much as is waiting at once
+typedef struct roundtrip_check RoundTripCheck;
+struct roundtrip_check {
+
+	RoundTripTrack *tracks;
+	RoundTripDue heap[MAX_TRACKS];		// the tracks with events left, soonest first
+	int 		heap_len;
+	uint16_t 	channels;				// a bit for each channel midi_want_channel wants
+	RoundTripEvent *events;
+	int 		num_events;				// that have been used
+	int 		events_mem;
+	int 		free;					// the first unused one before num_events, or -1
+	uint32_t 	waiting;				// how many are in the lists
+	int 		head[ROUNDTRIP_BUCKETS];
+	int 		tail[ROUNDTRIP_BUCKETS];
+};
+
+// the release truncation of midi_process_track_data, for a note that played for duration_usec
+unsigned long roundtrip_truncation(MIDIFile *midi, uint64_t duration_usec) {
+
+	unsigned long notemin_usec = midi->options.notemin_usec;
+	unsigned long releasetime_usec = midi->options.releasetime_usec;
+	if (duration_usec <= notemin_usec) return 0;
+	if (duration_usec < releasetime_usec + notemin_usec) return duration_usec - notemin_usec;
+	return releasetime_usec;
+}
+
+// move a track on to its next event that is checked, and work out when it is
+void roundtrip_track_next(MIDIFile *midi, RoundTripCheck *check, int tracknum, RoundTripTrack *track) {
+
+	MIDIEventIndex *ndx = midi->index;
+	MIDITempoMap *map = &midi->tempo_map;
+	int e = track->event, end = ndx->track_start[tracknum + 1];
+
+	for (; e < end; ++e) {
+		byte cmd = ndx->cmd[e];
+		if ((cmd == CMD_PLAYNOTE || cmd == CMD_STOPNOTE) ? (check->channels >> ndx->chan[e]) & 1
+		    : cmd == CMD_PED0 || cmd == CMD_PED1 || cmd == CMD_PED2)
+			break;
+	}
+	track->event = e;
+	if (e == end) {
+		track->usec = UINT64_MAX;
+		return;
+	}
+
+	// midi_tempo_map_usec, but a track's ticks only go forward, so the change is found by stepping to it
+	uint64_t tick = ndx->time[e];
+	while (track->change + 1 < map->len && map->changes[track->change + 1].tick <= tick) ++track->change;
+	MIDITempoChange *change = &map->changes[track->change];
+	track->usec = change->usec + (tick - change->tick) * change->tempo / map->ticks_per_beat;
+}
+
+void roundtrip_sift_down(RoundTripCheck *check) {
+
+	RoundTripDue *heap = check->heap, top = heap[0];
+	int ndx = 0;
+
+	while (1) {
+		int child = 2 * ndx + 1;
+		if (child >= check->heap_len) break;
+		if (child + 1 < check->heap_len && heap[child + 1].usec < heap[child].usec) ++child;
+		if (heap[child].usec >= top.usec) break;
+
+		heap[ndx] = heap[child];
+		ndx = child;
+	}
+	heap[ndx] = top;
+}
+
+// False if there's no memory for it
+int roundtrip_add(RoundTripCheck *check, int bucket, uint64_t usec, uint32_t slack_usec) {
+
+	int n = check->free;
+	if (n >= 0) check->free = check->events[n].next;
+	else {
+		if (check->num_events == check->events_mem) {
+			int mem = check->events_mem ? 2 * check->events_mem : 1024;
+			RoundTripEvent *events = (RoundTripEvent*)realloc(check->events, sizeof(RoundTripEvent) * mem);
+			if (!events) return False;
+			check->events = events;
+			check->events_mem = mem;
+		}
+		n = check->num_events++;
+	}
+	check->events[n].usec = usec;
+	check->events[n].slack_usec = slack_usec;
+	check->events[n].next = -1;
+	if (check->tail[bucket] < 0) check->head[bucket] = n;
+	else check->events[check->tail[bucket]].next = n;
+	check->tail[bucket] = n;
+	++check->waiting;
+	return True;
+}
+
+// take event n, which comes after prev, out of its bucket's list, and free it
+void roundtrip_remove(RoundTripCheck *check, int bucket, int n, int prev) {
+
+	int next = check->events[n].next;
+	if (prev < 0) check->head[bucket] = next;
+	else check->events[prev].next = next;
+	if (check->tail[bucket] == n) check->tail[bucket] = prev;
+	check->events[n].next = check->free;
+	check->free = n;
+	--check->waiting;
+}
+
+/* When a note is started again on its track before it stops, the conversion stops whichever
+   copy has the lowest slot, which depends on what all the other tracks were playing at the
+   time. Rather than replaying the whole merge, the stop is allowed to be anywhere between the
+   releases of the copies it could have ended, and the copy left playing inherits the range.
+   With no release time the truncation is zero and the stops are exact anyway. */
+
+// read the score's events that are before until_usec into the lists, soonest first; False if there's no memory
+int roundtrip_read(MIDIFile *midi, RoundTripCheck *check, uint64_t until_usec) {
+
+	MIDIEventIndex *ndx = midi->index;
+
+	while (check->heap_len > 0 && check->heap[0].usec < until_usec) {
+
+		int tracknum = check->heap[0].tracknum;
+		RoundTripTrack *track = &check->tracks[tracknum];
+		int e = track->event;
+		byte cmd = ndx->cmd[e];
+		uint64_t usec = track->usec;
+		uint32_t slack_usec = 0;
+		bool wanted = true;
+
+		if (cmd == CMD_PLAYNOTE) {
+			if (track->num_sounding == track->sounding_mem) {
+				int mem = track->sounding_mem ? 2 * track->sounding_mem : 64;
+				RoundTripNote *sounding = (RoundTripNote*)realloc(track->sounding, sizeof(RoundTripNote) * mem);
+				if (!sounding) return False;
+				track->sounding = sounding;
+				track->sounding_mem = mem;
+			}
+			RoundTripNote *np = &track->sounding[track->num_sounding++];
+			np->note = ndx->note[e];
+			np->start_usec = np->latest_usec = usec;
+		}
+		else if (cmd == CMD_STOPNOTE) {
+			RoundTripNote *sounding = track->sounding;
+			int s, copies = 0;
+			uint64_t start_usec = UINT64_MAX, latest_usec = 0;
+			for (int c = 0; c < track->num_sounding; ++c) {
+				if (sounding[c].note != ndx->note[e]) continue;
+				if (copies++ == 0) s = c;
+				if (sounding[c].start_usec < start_usec) start_usec = sounding[c].start_usec;
+				if (sounding[c].latest_usec > latest_usec) latest_usec = sounding[c].latest_usec;
+			}
+			if (copies == 0) wanted = false; // not playing, so the conversion drops it
+			else {
+				// the release is taken off the end, as in midi_process_track_data
+				unsigned long least = roundtrip_truncation(midi, usec - latest_usec);
+				unsigned long most = roundtrip_truncation(midi, usec - start_usec);
+				slack_usec = (uint32_t)(most - least);
+				usec -= least;
+
+				memmove(&sounding[s], &sounding[s + 1], sizeof(RoundTripNote) * (track->num_sounding - s - 1));
+				--track->num_sounding;
+				if (copies > 1) { // any of them could be the one still playing
+					for (int c = 0; c < track->num_sounding; ++c) {
+						if (sounding[c].note != ndx->note[e]) continue;
+						sounding[c].start_usec = start_usec;
+						sounding[c].latest_usec = latest_usec;
+					}
+				}
+			}
+		}
+
+		if (wanted && !roundtrip_add(check, roundtrip_bucket(cmd, ndx->note[e], ndx->value[e]), usec, slack_usec))
+			return False;
+
+		++track->event;
+		roundtrip_track_next(midi, check, tracknum, track);
+		if (track->usec == UINT64_MAX) check->heap[0] = check->heap[--check->heap_len];
+		else check->heap[0].usec = track->usec;
+		if (check->heap_len > 0) roundtrip_sift_down(check);
+	}
+	return True;
+}
+
+/* The delays are whole msec, so an event is output within 1 msec of its time. Each decoded
+   event takes the waiting one that can still be matched and runs out soonest; the ones that
+   ran out before it are missing. */
+
+void roundtrip_match(RoundTripCheck *check, int bucket, uint64_t d, MIDIRoundTrip *result) {
+
+	int best = -1, best_prev = -1, prev = -1;
+	for (int n = check->head[bucket]; n >= 0; ) {
+		RoundTripEvent *event = &check->events[n];
+		int next = event->next;
+		if (event->usec + 1000 <= d) {
+			roundtrip_remove(check, bucket, n, prev);
+			++result->missing;
+		}
+		else {
+			if (roundtrip_earliest(event) < d + 1000 && (best < 0 || event->usec < check->events[best].usec
+			    || (event->usec == check->events[best].usec && roundtrip_earliest(event) < roundtrip_earliest(&check->events[best])))) {
+				best = n;
+				best_prev = prev;
+			}
+			prev = n;
+		}
+		n = next;
+	}
+	if (best < 0) {
+		++result->extra;
+		return;
+	}
+
+	uint64_t latest = check->events[best].usec, earliest = roundtrip_earliest(&check->events[best]);
+	uint64_t error = d < earliest ? earliest - d : d > latest ? d - latest : 0;
+	if (error > result->max_error_usec) result->max_error_usec = (uint32_t)error;
+	++result->matched;
+	roundtrip_remove(check, bucket, best, best_prev);
+}
+
+/// Compare a decoded bytestream with the score midi was loaded from; returns True if every
+/// event is there at the right time, and False if not or if the score is broken (see midi->error)
+int midi_check_roundtrip(MIDIFile *midi, const MIDIStream *stream, MIDIRoundTrip *result) {
+
+	memset(result, 0, sizeof(MIDIRoundTrip));
+
+	if (!midi->tempo_map.complete && !midi_build_tempo_map(midi)) // which builds the index too
+		return False;
+
+	RoundTripCheck *check = (RoundTripCheck*)malloc(sizeof(RoundTripCheck));
+	RoundTripTrack *tracks = (RoundTripTrack*)calloc(midi->num_tracks + 1, sizeof(RoundTripTrack));
+	if (!check || !tracks) {
+		free(check);
+		free(tracks);
+		return midi_fail(midi, "out of memory");
+	}
+	check->tracks = tracks;
+	check->heap_len = 0;
+	check->channels = 0;
+	for (int chan = 0; chan < 16; ++chan)
+		if (midi_want_channel(midi, chan)) check->channels |= 1 << chan;
+	check->events = NULL;
+	check->num_events = check->events_mem = 0;
+	check->free = -1;
+	check->waiting = 0;
+	memset(check->head, 0xff, sizeof(check->head));
+	memset(check->tail, 0xff, sizeof(check->tail));
+
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
+		tracks[tracknum].event = midi->index->track_start[tracknum];
+		roundtrip_track_next(midi, check, tracknum, &tracks[tracknum]);
+		if (tracks[tracknum].usec == UINT64_MAX) continue;
+
+		int ndx = check->heap_len++; // sift it up
+		for (; ndx > 0 && check->heap[(ndx - 1) / 2].usec > tracks[tracknum].usec; ndx = (ndx - 1) / 2)
+			check->heap[ndx] = check->heap[(ndx - 1) / 2];
+		check->heap[ndx].usec = tracks[tracknum].usec;
+		check->heap[ndx].tracknum = tracknum;
+	}
+
+	/* The decoded events are in time order, and the score's are read along with them, up to the
+	   last that could match the decoded event: its time plus the msec of rounding, plus the
+	   release, which is as much earlier as a stop can be. */
+	uint64_t releasetime_usec = midi->options.releasetime_usec;
+	int read = True;
+	for (uint32_t e = 0; read && e < stream->num_events; ++e) {
+		int bucket = roundtrip_stream_bucket(&stream->events[e]);
+		if (bucket < 0) continue;
+		uint64_t d = stream->events[e].time_msec * 1000;
+		read = roundtrip_read(midi, check, d + 1000 + releasetime_usec);
+		roundtrip_match(check, bucket, d, result);
+	}
+	if (read) read = roundtrip_read(midi, check, UINT64_MAX); // the rest of the score
+	result->missing += check->waiting;
+
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) free(tracks[tracknum].sounding);
+	free(tracks);
+	free(check->events);
+	free(check);
+
+	if (!read) return midi_fail(midi, "out of memory");
+	return result->missing == 0 && result->extra == 0;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "midilib.h"
+
+
+/*
+	Convert many MIDI files at once.
+
+	Usage: midibatch [-j threads] [-c] [-o outdir] <file or directory>...
+
+	Directories contribute every .mid and .midi file in them. With -o, each input is written
+	to outdir as <name>.bin; without it the files are only converted, which is useful for timing.
+	Inputs that would be written to the same file, like a/x.mid and b/x.mid, or x.mid and x.midi,
+	are an error, found before anything is converted.
+	-c writes the compact format. The totals, with files/sec and MB/sec, go to stderr.
+*/
+
+
+typedef struct path_list PathList;
+struct path_list {
+
+	char 		**paths;
+	int 		num;
+	int 		mem;
+};
+
+void path_add(PathList *list, const char *path) {
+
+	if (list->num == list->mem) {
+		list->mem = list->mem ? 2 * list->mem : 256;
+		list->paths = (char**)realloc(list->paths, sizeof(char*) * list->mem);
+	}
+	list->paths[list->num++] = strdup(path);
+}
+
+int is_midi_name(const char *name) {
+
+	const char *ext = strrchr(name, '.');
+	return ext && (strcasecmp(ext, ".mid") == 0 || strcasecmp(ext, ".midi") == 0);
+}
+
+void add_input(PathList *list, const char *path) {
+
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		path_add(list, path);
+		return;
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		perror(path);
+		return;
+	}
+
+	struct dirent *ent;
+	char full[4096];
+	while ((ent = readdir(dir))) {
+		if (!is_midi_name(ent->d_name)) continue;
+		snprintf(full, sizeof(full), "%s/%s", path, ent->d_name);
+		path_add(list, full);
+	}
+	closedir(dir);
+}
+
+/// outdir/<name of the input, without its extension>.bin
+char *output_name(const char *outdir, const char *midifile) {
+
+	const char *name = strrchr(midifile, '/');
+	name = name ? name + 1 : midifile;
+
+	const char *ext = strrchr(name, '.');
+	int namelen = ext ? ext - name : (int)strlen(name);
+
+	size_t len = strlen(outdir) + namelen + 6;
+	char *out = (char*)malloc(len);
+	snprintf(out, len, "%s/%.*s.bin", outdir, namelen, name);
+	return out;
+}
+
+int item_outfile_before(const void *a, const void *b) {
+
+	return strcmp((*(const MIDIBatchItem**)a)->outfile, (*(const MIDIBatchItem**)b)->outfile);
+}
+
+/// Are two of the items written to the same file? They would both be written at once, on different threads.
+int outfiles_collide(MIDIBatchItem *items, int num_items) {
+
+	MIDIBatchItem **sorted = (MIDIBatchItem**)malloc(sizeof(MIDIBatchItem*) * num_items);
+	for (int i = 0; i < num_items; ++i) sorted[i] = &items[i];
+	qsort(sorted, num_items, sizeof(MIDIBatchItem*), item_outfile_before);
+
+	int collide = False;
+	for (int i = 1; i < num_items; ++i) {
+		if (strcmp(sorted[i - 1]->outfile, sorted[i]->outfile) == 0) {
+			fprintf(stderr, "%s and %s would both be written to %s\n", sorted[i - 1]->midifile, sorted[i]->midifile,
+			        sorted[i]->outfile);
+			collide = True;
+		}
+	}
+	free(sorted);
+	return collide;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	int num_threads = 0;
+	const char *outdir = NULL;
+	MIDIOptions options;
+	midi_default_options(&options);
+	PathList inputs = {0};
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) outdir = argv[++i];
+		else if (strcmp(argv[i], "-c") == 0) options.output_format = MIDI_FORMAT_COMPACT;
+		else add_input(&inputs, argv[i]);
+	}
+
+	if (inputs.num == 0) {
+		fprintf(stderr, "usage: midibatch [-j threads] [-c] [-o outdir] <file or directory>...\n");
+		return 1;
+	}
+
+	MIDIBatchItem *items = (MIDIBatchItem*)calloc(inputs.num, sizeof(MIDIBatchItem));
+	for (int i = 0; i < inputs.num; ++i) {
+		items[i].midifile = inputs.paths[i];
+		items[i].outfile = outdir ? output_name(outdir, inputs.paths[i]) : NULL;
+	}
+	if (outdir && outfiles_collide(items, inputs.num))
+		return 1;
+
+	MIDIBatchStats stats;
+	midi_binarize_batch(items, inputs.num, num_threads, &options, &stats);
+
+	for (int i = 0; i < inputs.num; ++i) {
+		if (items[i].result != 0) fprintf(stderr, "failed: %s: %s\n", items[i].midifile, items[i].error);
+	}
+
+	fprintf(stderr, "%d files, %d failed, %.3f sec: %.1f files/sec, %.2f MB/sec in, %.2f MB/sec out\n",
+	        stats.files, stats.failed, stats.seconds, stats.files / stats.seconds,
+	        stats.bytes_in / stats.seconds / (1 << 20), stats.bytes_out / stats.seconds / (1 << 20));
+
+	for (int i = 0; i < inputs.num; ++i) {
+		free(inputs.paths[i]);
+		free((char*)items[i].outfile);
+	}
+	free(inputs.paths);
+	free(items);
+
+	return stats.failed ? 2 : 0;
+}
@@ -7,21 +7,45 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "midilib.h"
 
-unsigned channel_mask = 0xffff;     // bit mask of channels to process
+
+// report to the trace hook; compiled out, arguments and all, unless DEBUG is defined
+#ifdef DEBUG
+#define MIDI_TRACE(midi, kind, cmd, track, chan, note, value, time) \
+	do { if ((midi)->trace) midi_trace_emit((midi), (kind), (cmd), (track), (chan), (note), (value), (time)); } while (0)
+#else
+#define MIDI_TRACE(midi, kind, cmd, track, chan, note, value, time) do { } while (0)
+#endif
+
+// go on to another stage of the conversion, if the time of each is being added up
+#define MIDI_STAGE(midi, next) \
+	do { if ((midi)->stage_timing) midi_stage_switch((midi), (next)); } while (0)
 
 
 /// Check that we have a specified number of bytes left in the buffer
 int check_bufferlen(byte *buffer, byte *ptr, unsigned long len, unsigned long buflen) {
 
-	if ((unsigned) (ptr + len - buffer) > buflen)
+	if (ptr < buffer || (unsigned long)(ptr - buffer) > buflen || len > buflen - (unsigned long)(ptr - buffer))
 		return False;
 
 	return True;
 }
 
+/// Record why the conversion can't go on, unless there already is a reason; returns False
+int midi_fail(MIDIFile *midi, const char *error) {
+
+	if (!midi->error)
+		midi->error = error;
+	return False;
+}
+
 /// portable string length
 int strlength (const char *str) {
 	int i;
@@ -44,14 +68,45 @@ uint16_t rev_short (uint16_t val) {
 }
 uint32_t rev_long (uint32_t val) {
 
-	return (((rev_short ((uint16_t) val) & 0xffff) << 16) | (rev_short ((uint16_t) (val >> 16)) & 0xffff));
+	return (((uint32_t) rev_short ((uint16_t) val) << 16) | (rev_short ((uint16_t) (val >> 16)) & 0xffff));
+}
+/*
+	Get a MIDI-style variable length integer and move the pointer past it. It is 1-4 bytes of 7
+	bits each, most significant first, with the top bit set on all but the last byte. No more than
+	4 bytes are read, and none at or past end.
+
+	This is done for every event's delta time, so it is the hottest thing in the parser. A single
+	byte is taken straight away. Otherwise, whenever 4 bytes are left, which is everywhere but the
+	very end of a track, the bounds are checked once for the whole number and the bytes are taken
+	unrolled; only near the end does it go a byte at
+	a time checking each one. (Finding the length all at once, from the top bits of a 4-byte load,
+	measured slower: the next delta's address then waits on that arithmetic, where a predicted
+	branch lets the processor run ahead.)
+*/
+unsigned long get_varlen(uint8_t **ptr, const uint8_t *end) {
+
+	uint8_t *p = *ptr;
+	if (p < end && p[0] < 0x80) { *ptr = p + 1; return p[0]; } // most deltas are a single byte
+
+	if (end - p < 4)
+		return get_varlen_bytewise(ptr, end);
+
+	unsigned long val = ((p[0] & 0x7f) << 7) | (p[1] & 0x7f);
+	if (p[1] < 0x80) { *ptr = p + 2; return val; }
+
+	val = (val << 7) | (p[2] & 0x7f);
+	if (p[2] < 0x80) { *ptr = p + 3; return val; }
+
+	val = (val << 7) | (p[3] & 0x7f);
+	*ptr = p + 4;
+	return val;
 }
-unsigned long get_varlen(uint8_t **ptr) { // get a MIDI-style variable length integer
 
-	/* Get a 1-4 byte variable-length value and adjust the pointer past it.
-	These are a succession of 7-bit values with a MSB bit of zero marking the end */
+/// The same a byte at a time, which is what get_varlen falls back to near the end of the data
+unsigned long get_varlen_bytewise(uint8_t **ptr, const uint8_t *end) {
+
 	unsigned long val = 0;
-	for (int i = 0; i < 4; ++i) {
+	for (int i = 0; i < 4 && *ptr < end; ++i) {
 		byte b = *(*ptr)++;
 		val = (val << 7) | (b & 0x7f);
 		if (!(b & 0x80))
@@ -63,63 +118,307 @@ unsigned long get_varlen(uint8_t **ptr) { // get a MIDI-style variable length in
 
 
 
+/// Map a regular file read-only into memory, so the parser reads straight from the page cache
+int midi_load_mmap(MIDIFile *midi, int fd) {
 
-MIDIFile* midi_load(const char* midifile) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return False; // pipes and the like can't be mapped
 
-	FILE *fmid = fopen(midifile, "rb");
-	if (!fmid) {
-		return NULL;
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return False;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	midi->data = (byte*)map;
+	midi->data_len = st.st_size;
+	midi->data_mapped = true;
+	return True;
+}
+
+/// Read the whole file into an allocated buffer, growing it as we go since the size may not be known
+int midi_load_read(MIDIFile *midi, int fd) {
+
+	struct stat st;
+	long mem = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size + 1 : 65536;
+
+	midi->data = (byte*)midi_arena_alloc(midi->arena, mem);
+	midi->data_len = 0;
+
+	while (1) {
+		if (midi->data_len == mem) {
+			mem *= 2;
+			midi->data = (byte*)midi_arena_grow(midi->arena, midi->data, midi->data_len, mem);
+		}
+
+		ssize_t bread = read(fd, midi->data + midi->data_len, mem - midi->data_len);
+		if (bread < 0) return False;
+		if (bread == 0) break;
+		midi->data_len += bread;
+	}
+	return True;
+}
+
+/// Fill in the options used when none are given
+void midi_default_options(MIDIOptions *options) {
+
+	options->channel_mask = 0xffff;
+	options->percussion_ignore = true;
+	options->notemin_usec = DEFAULT_NOTEMIN_USEC;
+	options->releasetime_usec = DEFAULT_RELEASETIME_USEC;
+	options->start_usec = 0;
+	options->end_usec = 0;
+	options->decode_threads = 0;
+	options->num_tonegens = 0;
+	options->tonegen_per_track = false;
+	options->output_format = MIDI_FORMAT_CLASSIC;
+}
+
+/// Load a file into a MIDIFile that is empty, either new or after midi_reset
+int midi_load_into(MIDIFile *midi, const char* midifile, int load_mode) {
+
+	if (!midi->arena) midi_set_arena(midi, NULL);
+
+	int fd = open(midifile, O_RDONLY);
+	if (fd < 0) {
+		return False;
+	}
+
+	// Map or read the whole input file into memory
+	int result = False;
+	if (load_mode == MIDI_LOAD_MMAP)
+		result = midi_load_mmap(midi, fd);
+	if (!result)
+		result = midi_load_read(midi, fd);
+	close(fd);
+
+	if (!result) {
+		return False;
 	}
 
+	midi->ticks_per_beat = DEFAULT_BEATTIME;
+	memset(midi->channel, 0, sizeof(ChannelStatus) * NUM_CHANNELS);
+	midi_default_options(&midi->options);
+
+	return True;
+}
+
+MIDIFile* midi_load(const char* midifile, int load_mode) {
+
 	MIDIFile *midi = (MIDIFile*)calloc(sizeof(MIDIFile), 1);
+	if (!midi) return NULL;
+
+	if (!midi_load_into(midi, midifile, load_mode)) {
+		midi_free(midi);
+		return NULL;
+	}
+	return midi;
+}
+
+/// Use a MIDI file that is already in memory. The data is not copied, and must outlive the MIDIFile.
+/// Returns NULL if there is no data, or no memory for the MIDIFile.
+MIDIFile* midi_load_buffer(const void *mididata, size_t midilen) {
+
+	if (!mididata) {
+		return NULL;
+	}
 
-	// Read the whole input file into memory
-	fseek(fmid, 0, SEEK_END); // find its size
-	midi->data_len = ftell(fmid);
-	fseek(fmid, 0, SEEK_SET);
+	MIDIFile *midi = (MIDIFile*)calloc(sizeof(MIDIFile), 1);
+	if (!midi) return NULL;
+	midi_set_arena(midi, NULL);
 
-	// allocate
-	midi->data = (byte *)malloc(midi->data_len + 1);
-	long bread = fread(midi->data, midi->data_len, 1, fmid);
-	fclose (fmid);
+	midi->data = (byte*)mididata; // the parser never writes to it
+	midi->data_len = midilen;
+	midi->data_borrowed = true;
 
 	midi->ticks_per_beat = DEFAULT_BEATTIME;
 	memset(midi->channel, 0, sizeof(ChannelStatus) * NUM_CHANNELS);
+	midi_default_options(&midi->options);
 
 	return midi;
 }
 
+// the channels' note slots (see "playing notes" below)
+void channel_free(MIDIFile *midi) {
+
+	for (int chan = 0; chan < NUM_CHANNELS; ++chan) {
+		ChannelStatus *cp = &midi->channel[chan];
+		midi_arena_drop(midi->arena, cp->notes_playing);
+		midi_arena_drop(midi->arena, cp->slot_busy);
+		midi_arena_drop(midi->arena, cp->slot_next);
+		cp->notes_playing = NULL;
+		cp->slot_busy = NULL;
+		cp->slot_next = NULL;
+		cp->num_slots = 0;
+	}
+}
+
 void midi_free(MIDIFile *midi) {
 
-	if (midi->data) free(midi->data);
+	if (midi->data && !midi->data_borrowed) {
+		if (midi->data_mapped) munmap(midi->data, midi->data_len);
+		else midi_arena_drop(midi->arena, midi->data);
+	}
+	if (midi->output && !midi->output_borrowed) free(midi->output);
+	if (midi->queue) free(midi->queue);
+	if (midi->events) free(midi->events);
+	channel_free(midi);
+	midi_free_index(midi);
+	midi_tempo_map_free(&midi->tempo_map);
+	midi_arena_free(&midi->own_arena);
 
 	free(midi);
 }
 
-void midi_writeoutput(MIDIFile *midi, byte msg) {
+/// Forget the loaded file and all conversion state, but keep the output and queue space to reuse,
+/// and the arena's blocks, which it resets
+void midi_reset(MIDIFile *midi) {
+
+	byte *output = midi->output_borrowed ? NULL : midi->output;
+	uint32_t output_mem = midi->output_borrowed ? 0 : midi->output_mem;
+	QEntry *queue = midi->queue;
+	int queue_mem = midi->queue_mem;
+	MIDIArena *arena = midi->arena;
+
+	if (midi->data && !midi->data_borrowed) {
+		if (midi->data_mapped) munmap(midi->data, midi->data_len);
+		else midi_arena_drop(midi->arena, midi->data);
+	}
+	if (midi->events) free(midi->events);
+	channel_free(midi);
+	midi_free_index(midi);
+	midi_tempo_map_free(&midi->tempo_map);
+	if (arena) midi_arena_reset(arena);
+	MIDIArena own_arena = midi->own_arena;
+
+	memset(midi, 0, sizeof(MIDIFile));
+	midi->output = output;
+	midi->output_mem = output_mem;
+	midi->queue = queue;
+	midi->queue_mem = queue_mem;
+	midi->own_arena = own_arena;
+	if (arena) midi_set_arena(midi, arena == &midi->own_arena ? NULL : arena);
+}
+
+/************** output sinks ******************
+
+Without a sink, the whole bytestream is built up in midi->output. With one, midi->output is a
+buffer of sink.chunk_size bytes which is handed to sink.write each time it fills up, so memory
+stays bounded however long the score is and the consumer can start before we are done.
+*/
+
+/// Send a chunk to an open file descriptor; arg is the descriptor cast with (void*)(intptr_t)
+int midi_write_fd(void *arg, const byte *data, uint32_t len) {
+
+	int fd = (int)(intptr_t)arg;
+	while (len > 0) {
+		ssize_t written = write(fd, data, len);
+		if (written < 0) return False;
+		data += written;
+		len -= written;
+	}
+	return True;
+}
+
+/// Send a chunk to a FILE*
+int midi_write_file(void *arg, const byte *data, uint32_t len) {
+
+	return fwrite(data, 1, len, (FILE*)arg) == len;
+}
+
+/// Stream the output to write() in chunks of chunk_size bytes, instead of keeping all of it
+void midi_set_sink(MIDIFile *midi, MIDIOutputFn write, void *arg, uint32_t chunk_size) {
+
+	midi->sink.write = write;
+	midi->sink.arg = arg;
+	midi->sink.chunk_size = chunk_size ? chunk_size : MIDI_SINK_CHUNK;
+}
+
+/// Hand what is in the output buffer to the sink, if there is one
+void midi_output_flush(MIDIFile *midi) {
+
+	if (!midi->sink.write || midi->output_len == 0)
+		return;
+
+	if (!midi->sink_error && !midi->sink.write(midi->sink.arg, midi->output, midi->output_len))
+		midi->sink_error = true; // the rest gets dropped
+
+	midi->output_flushed += midi->output_len;
+	midi->output_len = 0;
+}
+
+/// Make sure there is space for len more output bytes, at least doubling the space when it grows.
+/// Returns False, with the output as it was, if there is no memory or it would pass 4 GB.
+int midi_output_reserve(MIDIFile *midi, uint32_t len) {
+
+	uint64_t need = (uint64_t)midi->output_len + len;
+	if (midi->output_mem >= need)
+		return True;
+
+	if (midi->sink.write) { // make room by emptying the chunk
+		midi_output_flush(midi);
+		need = len;
+		if (midi->output_mem >= need) return True;
+	}
 
-	// check if there is space in the buffer
-	if (midi->output_mem < midi->output_len + 1) {
-		midi->output_mem += 512;
-		midi->output = (byte*)realloc(midi->output, sizeof(byte) * midi->output_mem);
+	if (need > UINT32_MAX)
+		return midi_fail(midi, "output too long");
+	uint64_t mem = midi->output_mem ? 2 * (uint64_t)midi->output_mem : 512;
+	if (mem < need) mem = need;
+	if (mem > UINT32_MAX) mem = UINT32_MAX;
+
+	byte *output;
+	if (midi->output_borrowed) { // outgrew the caller's space: move to our own
+		if (!(output = (byte*)malloc(sizeof(byte) * mem)))
+			return midi_fail(midi, "out of memory");
+		memcpy(output, midi->output, midi->output_len);
+		midi->output_borrowed = false;
 	}
+	else if (!(output = (byte*)realloc(midi->output, sizeof(byte) * mem)))
+		return midi_fail(midi, "out of memory");
+	midi->output = output;
+
+	if (midi->output_mem) midi->output_reallocs++; // the first allocation doesn't count
+	midi->output_mem = mem;
+	return True;
+}
+
+int midi_writeoutput(MIDIFile *midi, byte msg) {
+
+	if (midi->output_mem < midi->output_len + 1 && !midi_output_reserve(midi, 1))
+		return False;
 
 	midi->output[midi->output_len] = msg;
 	midi->output_len++;
+	return True;
+}
+
+/// Append a whole command at once
+int midi_writeoutput_bytes(MIDIFile *midi, const byte *msg, uint32_t len) {
+
+	if (midi->output_mem < (uint64_t)midi->output_len + len && !midi_output_reserve(midi, len))
+		return False;
+
+	memcpy(midi->output + midi->output_len, msg, len);
+	midi->output_len += len;
+	return True;
 }
 
 
 int midi_process_file_header(MIDIFile *midi) {
 
 	// check if there is enough
-	assert(check_bufferlen(midi->data, midi->data, sizeof(MIDIHeader), midi->data_len) == True);
+	if (!check_bufferlen(midi->data, midi->data, sizeof(MIDIHeader), midi->data_len))
+		return midi_fail(midi, "too short for a MIDI file header");
 
 	// get the header
 	midi->header = (MIDIHeader*)midi->data;
-	assert(strcompare((char *) midi->header->MThd, "MThd") == True); // check that it is a header
+	if (!strcompare((char *) midi->header->MThd, "MThd")) // check that it is a header
+		return midi_fail(midi, "not a MIDI file: no MThd header");
 
 	// convert some numbers from big endianess
 	midi->num_tracks = rev_short(midi->header->number_of_tracks);
+	midi->tracks_len = 0;
 	midi->time_division = rev_short(midi->header->time_division);
 
 	// get the time info
@@ -128,16 +427,13 @@ int midi_process_file_header(MIDIFile *midi) {
 	else
 		midi->ticks_per_beat = ((midi->time_division >> 8) & 0x7f) /* SMTE frames/sec */ *(midi->time_division & 0xff);     /* ticks/SMTE frame */
 
-	printf ("Header size %" PRId32 "\n", 	rev_long (midi->header->header_size));
-	printf ("Format type %d\n", 			rev_short (midi->header->format_type));
-	printf ("Number of tracks %d\n", 		midi->num_tracks);
-	printf ("Time division %04X\n", 		midi->time_division);
-	printf ("Ticks/beat = %d\n", 			midi->ticks_per_beat);
+	MIDI_TRACE(midi, TRACE_FILE_HEADER, 0, 0, 0, rev_short(midi->header->format_type), midi->num_tracks, midi->ticks_per_beat);
 
 	midi->content = midi->data + rev_long (midi->header->header_size) + 8;   /* point past header to track header, presumably. */
 	midi->dataptr = midi->content; // set the running pointer there too
 
-	assert(midi->num_tracks < MAX_TRACKS);
+	if (midi->num_tracks >= MAX_TRACKS)
+		return midi_fail(midi, "too many tracks");
 	memset(midi->track, 0, sizeof(TrackStatus) * MAX_TRACKS); // reset the tracks
 
 	return True;
@@ -148,26 +444,28 @@ int midi_process_track_header(MIDIFile *midi, int tracknum) {
 	int result;
 
 	// check that there is enough bytes in the data
-	result = check_bufferlen(midi->data, midi->dataptr, sizeof(TrackHeader), midi->data_len); assert(result == True);
+	result = check_bufferlen(midi->data, midi->dataptr, sizeof(TrackHeader), midi->data_len);
+	if (!result)
+		return midi_fail(midi, "track header past the end of the file");
 
 	// interpret bytes with the correct structure
 	TrackHeader *hdr = (TrackHeader*)midi->dataptr;
-	if (!strcompare((char *)(hdr->MTrk), "MTrk")) {
-		printf("Missing MTrk[%i] at %p\n", tracknum, midi->dataptr);
-		return False;
-	}
+	if (!strcompare((char *)(hdr->MTrk), "MTrk"))
+		return midi_fail(midi, "missing MTrk track header");
 
 	// length of the track in bytes
 	unsigned long tracklen = rev_long(hdr->track_size);
-	printf("\nTrack %d length %ld\n", tracknum, tracklen);
+	MIDI_TRACE(midi, TRACE_TRACK_HEADER, 0, tracknum, 0, 0, tracklen, 0);
 
 	midi->dataptr += sizeof(TrackHeader); // point past header
 	result = check_bufferlen(midi->data, midi->dataptr, tracklen, midi->data_len);
-	assert(result == True);
+	if (!result)
+		return midi_fail(midi, "track runs past the end of the file");
 
 	// set the track pointer to the track content at the current dataptr position
 	midi->track[tracknum].trkptr = midi->dataptr;
 
+	midi->tracks_len += tracklen;
 	midi->dataptr += tracklen; 						// point to the start of the next track
 	midi->track[tracknum].trkend = midi->dataptr; 	// the point past the end of the track
 
@@ -184,15 +482,21 @@ void midi_show_meta(TrackStatus *t, int meta_cmd, int meta_length, char *tag) {
 	printf("\"\n");
 }
 
-int midi_note_off(TrackStatus *t, int chan) {
+/// Are we processing notes on this channel?
+int midi_want_channel(MIDIFile *midi, int chan) {
+
+	if (!((1 << chan) & midi->options.channel_mask)) return False;
+	if (chan == PERCUSSION_TRACK && midi->options.percussion_ignore) return False;
+	return True;
+}
+
+int midi_note_off(MIDIFile *midi, TrackStatus *t, int chan) {
 
-	#ifdef DEBUG
-	printf("note %d (0x%02X) off, channel %d, volume %d\n", t->note, t->note, chan, t->volume);
-	#endif
+	MIDI_TRACE(midi, TRACE_PARSE_NOTE_OFF, 0, t - midi->track, chan, t->note, t->volume, t->time);
 
 	// note_off:
 	// we're processing this channel and not ignoring percussions...
-	if ((1 << chan) & channel_mask && (chan != PERCUSSION_TRACK)) {  // and not ignoring percussion
+	if (midi_want_channel(midi, chan)) {
 		t->chan = 0; // force all notes to channel 0 cos we dont really care about ensembles!
 		t->cmd = CMD_STOPNOTE;    /* stop processing and return */
 		return True;
@@ -201,6 +505,12 @@ int midi_note_off(TrackStatus *t, int chan) {
 	return False;
 }
 
+/// How many data bytes follow a channel event, or the least that do for sysex
+int midi_event_len(int event) {
+
+	return (event >> 4) == 0xc || (event >> 4) == 0xd || (event >> 4) == 0xf ? 1 : 2;
+}
+
 int midi_find_next_note(MIDIFile *midi, int tracknum) {
 
 	unsigned long delta_ticks;
@@ -214,35 +524,30 @@ int midi_find_next_note(MIDIFile *midi, int tracknum) {
 
 	while (t->trkptr < t->trkend) { // do until the end of the track
 
-		delta_ticks = get_varlen(&t->trkptr);
+		delta_ticks = get_varlen(&t->trkptr, t->trkend);
 		t->time += delta_ticks;
-
-		#ifdef DEBUG
-		printf("# trk %d ", tracknum);
-		printf("at ticks+%lu=%lu: ", delta_ticks, t->time);
-		if (delta_ticks > 0) printf(" [ticks+%-5lu%7lu] ", delta_ticks, t->time);
-		else printf(" [ticks+<=0] ");
-		#endif
+		if (t->trkptr >= t->trkend)
+			return midi_fail(midi, "event past the end of a track");
 
 		if (*t->trkptr < 0x80) event = t->last_event;  // using "running status": same event as before
 		else event = *t->trkptr++; // otherwise get new "status" (event type) */
 
 		if (event == 0xff) { // meta-event
 
+			if (t->trkptr >= t->trkend)
+				return midi_fail(midi, "event past the end of a track");
 			meta_cmd = *t->trkptr++;
-			meta_length = get_varlen(&t->trkptr);
+			meta_length = get_varlen(&t->trkptr, t->trkend);
+			if (meta_length > t->trkend - t->trkptr || (meta_cmd == 0x51 && meta_length < 3))
+				return midi_fail(midi, "bad meta event length");
 
-			#ifdef DEBUG
-			printf(" meta event...\n");
-			#endif
+			MIDI_TRACE(midi, TRACE_PARSE_META, 0, tracknum, 0, meta_cmd, meta_length, t->time);
 
 			if (meta_cmd == 0x51) {
 
 				t->cmd = CMD_TEMPO;
 				t->tempo = rev_long (*(uint32_t*)(t->trkptr - 1)) & 0xffffffL;
-				#ifdef DEBUG
-				printf ("\t SET TEMPO %ld usec/qnote\n", t->tempo);
-				#endif
+				MIDI_TRACE(midi, TRACE_PARSE_TEMPO, 0, tracknum, 0, 0, t->tempo, t->time);
 
 				t->trkptr += meta_length;
 				return True;
@@ -250,14 +555,15 @@ int midi_find_next_note(MIDIFile *midi, int tracknum) {
 			t->trkptr += meta_length;
 		}
 		else if (event < 0x80) {
-			printf("Unknown MIDI event type at %p\n", t->trkptr);
-			return False;
+			return midi_fail(midi, "unknown MIDI event type");
 		}
 		else { // all other events
 
 			if (event < 0xf0)
 				t->last_event = event;      // remember "running status" if not meta or sysex event
 			t->chan = chan = event & 0xf;
+			if (t->trkend - t->trkptr < midi_event_len(event))
+				return midi_fail(midi, "event past the end of a track");
 
 			switch (event >> 4) {
 
@@ -265,7 +571,7 @@ int midi_find_next_note(MIDIFile *midi, int tracknum) {
 				t->note = *t->trkptr++;
 				t->volume = *t->trkptr++;
 
-				if (midi_note_off(t, chan)) return True;
+				if (midi_note_off(midi, t, chan)) return True;
 
 				break;
 			case 0x9: // note on
@@ -273,15 +579,13 @@ int midi_find_next_note(MIDIFile *midi, int tracknum) {
 				t->volume = *t->trkptr++;
 
 				if (t->volume == 0) { // some scores use note-on with zero velocity for off!
-					if (midi_note_off(t, chan)) return True;
+					if (midi_note_off(midi, t, chan)) return True;
 				}
 
-				#ifdef DEBUG
-				printf("note %d (0x%02X) on,  channel %d, volume %d\n", t->note, t->note, chan, t->volume);
-				#endif
+				MIDI_TRACE(midi, TRACE_PARSE_NOTE_ON, 0, tracknum, chan, t->note, t->volume, t->time);
 
 				// we're processing this channel and not ignoring percussion
-				if ((1 << chan) & channel_mask && (chan != PERCUSSION_TRACK)) {
+				if (midi_want_channel(midi, chan)) {
 					t->chan = 0; // force all notes to channel 0
 					t->cmd = CMD_PLAYNOTE;    /* stop processing and return */
 					return True;
@@ -290,16 +594,12 @@ int midi_find_next_note(MIDIFile *midi, int tracknum) {
 			case 0xa: // key pressure
 				note = *t->trkptr++;
 				velocity = *t->trkptr++;
-				#ifdef DEBUG
-				printf("channel %d: note %d (0x%02X) has key pressure %d\n", chan, note, note, velocity);
-				#endif
+				MIDI_TRACE(midi, TRACE_PARSE_KEY_PRESSURE, 0, tracknum, chan, note, velocity, t->time);
 				break;
 			case 0xb: // control value change
 				controller = *t->trkptr++;
 				velocity = *t->trkptr++;
-				#ifdef DEBUG
-				printf("channel %d: change control value of controller %d to %d\n", chan, controller, velocity);
-				#endif
+				MIDI_TRACE(midi, TRACE_PARSE_CONTROL, 0, tracknum, chan, controller, velocity, t->time);
 				if (controller == 64) { // PEDALS ADDED BY FELIX
 					t->cmd = CMD_PED0;
 					t->pedalVals[0] = velocity;
@@ -320,430 +620,1629 @@ int midi_find_next_note(MIDIFile *midi, int tracknum) {
 			case 0xc: // program patch, ie which instrument
 				instrument = *t->trkptr++;
 				midi->channel[chan].instrument = instrument;    // record new instrument for this channel
-				#ifdef DEBUG
-				printf("channel %d: program patch to instrument %d\n", chan, instrument);
-				#endif
+				MIDI_TRACE(midi, TRACE_PARSE_PROGRAM, 0, tracknum, chan, 0, instrument, t->time);
 				break;
 			case 0xd: // channel pressure
 				pressure = *t->trkptr++;
-				#ifdef DEBUG
-				printf("channel %d: after-touch pressure is %d\n", chan, pressure);
-				#endif
+				MIDI_TRACE(midi, TRACE_PARSE_PRESSURE, 0, tracknum, chan, 0, pressure, t->time);
 				break;
 			case 0xe: // pitch wheel change
-				pitchbend = *t->trkptr++ | (*t->trkptr++ << 7);
-				#ifdef DEBUG
-				printf("pitch wheel change to %d\n", pitchbend);
-				#endif
+				pitchbend = t->trkptr[0] | (t->trkptr[1] << 7);
+				t->trkptr += 2;
+				MIDI_TRACE(midi, TRACE_PARSE_PITCHBEND, 0, tracknum, chan, 0, pitchbend, t->time);
 				break;
 			case 0xf: // sysex event
-				sysex_length = get_varlen(&t->trkptr);
-				#ifdef DEBUG
-				printf("SysEx event %d with %ld bytes\n", event, sysex_length);
-				#endif
+				sysex_length = get_varlen(&t->trkptr, t->trkend);
+				if (sysex_length > (unsigned long)(t->trkend - t->trkptr))
+					return midi_fail(midi, "bad sysex event length");
+				MIDI_TRACE(midi, TRACE_PARSE_SYSEX, 0, tracknum, 0, event, sysex_length, t->time);
 				t->trkptr += sysex_length;
 				break;
 			default:
-				printf("Unknown MIDI command at %p\n", t->trkptr);
-				return False;
+				return midi_fail(midi, "unknown MIDI command");
 			}
 		}
 	}
 	t->cmd = CMD_TRACKDONE;   //no more events to process on this track
 	++midi->tracks_done;
+	return True;
 }
 
-char *describe(NoteInfo *np) { // create a description of a note
-	// WARNING: returns a pointer to a static string, so only call once per line, in a printf!
-	static char notedescription[100];
-	sprintf(notedescription, "at %lu.%03lu msec, note %d (0x%02X) track %d channel %d volume %d instrument %d",
-	        np->time_usec / 1000, np->time_usec % 1000, np->note, np->note,
-	        np->track, np->channel, np->volume, np->instrument);
-
-	return notedescription;
+/************** event index ******************
+
+The index has a column for each field of the events, each grown by doubling as the tracks are
+decoded, and the events of each track one after the other. Converting from it walks each track's
+events in order, which is sequential memory access, and only has to decide which channels are
+wanted: everything to do with the byte format is done once, when it is built.
+*/
+
+// double the space in every column; False if there's no memory, with the columns as they were
+int index_grow(MIDIEventIndex *ndx) {
+
+	int old = ndx->mem, mem = ndx->mem ? 2 * ndx->mem : 1024;
+	void *col;
+
+	// each column that has moved is kept, so a failure part way leaves nothing to leak
+	if (!(col = midi_arena_grow(ndx->arena, ndx->time, sizeof(uint64_t) * old, sizeof(uint64_t) * mem))) return False;
+	ndx->time = (uint64_t*)col;
+	if (!(col = midi_arena_grow(ndx->arena, ndx->cmd, old, mem))) return False;
+	ndx->cmd = (byte*)col;
+	if (!(col = midi_arena_grow(ndx->arena, ndx->chan, old, mem))) return False;
+	ndx->chan = (byte*)col;
+	if (!(col = midi_arena_grow(ndx->arena, ndx->note, old, mem))) return False;
+	ndx->note = (byte*)col;
+	if (!(col = midi_arena_grow(ndx->arena, ndx->value, sizeof(uint32_t) * old, sizeof(uint32_t) * mem))) return False;
+	ndx->value = (uint32_t*)col;
+
+	ndx->mem = mem;
+	return True;
 }
 
+// add an event to the index, making space as needed; False if there's no memory for it
+int index_add(MIDIEventIndex *ndx, uint64_t time, byte cmd, byte chan, byte note, uint32_t value) {
 
-// queue a "note on" or "note off" command
-void queue_cmd(MIDIFile *midi, byte cmd, NoteInfo *np) {
+	if (ndx->num_events == ndx->mem && !index_grow(ndx))
+		return False;
 
-	#ifdef DEBUG
-	if (cmd == CMD_PLAYNOTE) {
-		printf("EN  queue PLAY %s\n", describe(np));
-	} else if (cmd == CMD_STOPNOTE) {
-		printf("EN  queue STOP %s\n", describe(np));
-	} else if (cmd == CMD_PED0 || cmd == CMD_PED1 || cmd == CMD_PED1) {
-		printf("EN  queue PED %02X %i\n", cmd, np->volume);
-	}
-	#endif
+	int e = ndx->num_events++;
+	ndx->time[e] = time;
+	ndx->cmd[e] = cmd;
+	ndx->chan[e] = chan;
+	ndx->note[e] = note;
+	ndx->value[e] = value;
+	return True;
+}
 
-	if (midi->queue_numitems == QUEUE_SIZE) pull_queue();
-	assert(midi->queue_numitems < QUEUE_SIZE);
+// decode one track, whose header has been processed, onto the end of ndx; only reads the track data,
+// and returns NULL or why it can't be decoded
+const char *index_track(MIDIFile *midi, MIDIEventIndex *ndx, int tracknum) {
 
-	uint32_t horizon = midi->output_usec + midi->output_deficit_usec;
-	if (np->time_usec < horizon) { // don't allow revisionist history
-		#ifdef DEBUG
-		printf("EN  event delayed by %lu usec because queue is too small\n", horizon - np->time_usec);
-		#endif
+	TrackStatus *t = &midi->track[tracknum];
+	uint8_t *ptr = t->trkptr;
+	uint64_t time = 0;
+	int event, last_event = 0;
+	int added = True;
 
-		np->time_usec = horizon;
-	}
+	while (added && ptr < t->trkend) {
 
-	int ndx;
-	if (midi->queue_numitems == 0) { // queue is empty; restart it
-		ndx = midi->queue_oldest_ndx = midi->queue_newest_ndx = midi->queue_numitems = 0;
-	}
-	else {
-		// find a place to insert the new entry in time order
-		// this is a stable incremental insertion sort
-		ndx = midi->queue_newest_ndx; // start with newest, since we are most often newer
-		while (midi->queue[ndx].note.time_usec > np->time_usec) { // search backwards for something as new or older
-			if (ndx == midi->queue_oldest_ndx) { // none: we are oldest; add to the start
-				if (--midi->queue_oldest_ndx < 0)
-					midi->queue_oldest_ndx = QUEUE_SIZE - 1;
-				ndx = midi->queue_oldest_ndx;
-
-				midi->queue_numitems++;
-				midi->queue[ndx].cmd = cmd;   // fille in the queue entry
-				midi->queue[ndx].note = *np;  // structure copy of the note
-				return;
-			}
+		time += get_varlen(&ptr, t->trkend);
+		if (ptr >= t->trkend) return "event past the end of a track";
+
+		if (*ptr < 0x80) event = last_event;
+		else event = *ptr++;
 
-			if (--ndx < 0) ndx = QUEUE_SIZE - 1;
+		if (event == 0xff) { // meta-event: only tempo matters
+
+			if (ptr >= t->trkend) return "event past the end of a track";
+			int meta_cmd = *ptr++;
+			unsigned long meta_length = get_varlen(&ptr, t->trkend);
+			if (meta_length > (unsigned long)(t->trkend - ptr) || (meta_cmd == 0x51 && meta_length < 3))
+				return "bad meta event length";
+			if (meta_cmd == 0x51)
+				added = index_add(ndx, time, CMD_TEMPO, 0, 0, rev_long(*(uint32_t*)(ptr - 1)) & 0xffffffL);
+			ptr += meta_length;
+			continue;
+		}
+		if (event < 0x80) {
+			return "unknown MIDI event type";
 		}
 
-		// we are to insert the new item after "ndx", so shift all later entries down, if any
-		int from_ndx, to_ndx;
-		if (++midi->queue_newest_ndx >= QUEUE_SIZE)
-			midi->queue_newest_ndx = 0;
-		to_ndx = midi->queue_newest_ndx;
-		while (1) {
-			if ((from_ndx = to_ndx - 1) < 0) from_ndx = QUEUE_SIZE - 1;
-			if (from_ndx == ndx) break;
-			midi->queue[to_ndx] = midi->queue[from_ndx]; // structure copy
-			to_ndx = from_ndx;
+		if (event < 0xf0)
+			last_event = event;
+		byte chan = event & 0xf;
+		if (t->trkend - ptr < midi_event_len(event))
+			return "event past the end of a track";
+
+		switch (event >> 4) {
+
+		case 0x8: // note off
+			added = index_add(ndx, time, CMD_STOPNOTE, chan, ptr[0], ptr[1]);
+			ptr += 2;
+			break;
+		case 0x9: // note on, or off if the volume is zero
+			added = index_add(ndx, time, ptr[1] ? CMD_PLAYNOTE : CMD_STOPNOTE, chan, ptr[0], ptr[1]);
+			ptr += 2;
+			break;
+		case 0xb: // control value change: only the pedals matter
+			if (ptr[0] == 64) added = index_add(ndx, time, CMD_PED0, chan, 0, ptr[1]);
+			else if (ptr[0] == 66) added = index_add(ndx, time, CMD_PED1, chan, 0, ptr[1]);
+			else if (ptr[0] == 67) added = index_add(ndx, time, CMD_PED2, chan, 0, ptr[1]);
+			ptr += 2;
+			break;
+		case 0xc: // program patch
+			added = index_add(ndx, time, CMD_INSTRUMENT, chan, 0, ptr[0]);
+			ptr += 1;
+			break;
+		case 0xa: // key pressure
+		case 0xe: // pitch wheel change
+			ptr += 2;
+			break;
+		case 0xd: // channel pressure
+			ptr += 1;
+			break;
+		case 0xf: { // sysex event
+			unsigned long sysex_length = get_varlen(&ptr, t->trkend);
+			if (sysex_length > (unsigned long)(t->trkend - ptr)) return "bad sysex event length";
+			ptr += sysex_length;
+			break;
+		}
 		}
-		if (++ndx >= QUEUE_SIZE) ndx = 0;
 	}
+	return added ? NULL : "out of memory";
+}
 
-	// store the item at ndx
-	++midi->queue_numitems;
-	midi->queue[ndx].cmd = cmd;   // fille in the queue entry
-	midi->queue[ndx].note = *np;  // structure copy of the note
+// an empty index, with its columns to come from midi's arena; NULL if there's no memory
+MIDIEventIndex *index_new(MIDIFile *midi) {
+
+	MIDIEventIndex *ndx = (MIDIEventIndex*)midi_arena_alloc(midi->arena, sizeof(MIDIEventIndex));
+	if (!ndx) return NULL;
+	memset(ndx, 0, sizeof(MIDIEventIndex));
+	ndx->arena = midi->arena;
+	return ndx;
 }
 
-// output a delay command
-void generate_delay(MIDIFile *midi, uint64_t delta_msec) {
+/// Decode all the tracks into midi->index, which midi_convert then uses instead of the track data
+int midi_build_index(MIDIFile *midi) {
 
-	if (delta_msec > 0) {
+	midi_free_index(midi);
+	if (!midi_process_file_header(midi))
+		return False;
 
-		assert(delta_msec <= 0x7fff); // "time delta too big"
+	if (!(midi->index = index_new(midi)))
+		return midi_fail(midi, "out of memory");
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
 
-		#ifdef DEBUG
-		if (midi->last_output_was_delay) {
-			printf("EN      *** this is a consecutive delay, of %lu msec\n", delta_msec);
+		midi->index->track_start[tracknum] = midi->index->num_events;
+		const char *error = NULL;
+		if (!midi_process_track_header(midi, tracknum) || (error = index_track(midi, midi->index, tracknum))) {
+			midi_free_index(midi);
+			return error ? midi_fail(midi, error) : False;
 		}
-		#endif
-		midi->last_output_was_delay = true;
-
-		// output a 15-bit delay in big-endian format
-		midi_writeoutput(midi, (byte)(delta_msec >> 8));
-		midi_writeoutput(midi, (byte)(delta_msec & 0xff));
 	}
+	midi->index->track_start[midi->num_tracks] = midi->index->num_events;
+	return True;
 }
 
+// space for mem events in each column of an empty index; False if there's no memory
+int index_alloc_columns(MIDIEventIndex *ndx, int mem) {
 
+	ndx->mem = mem;
+	ndx->time = (uint64_t*)midi_arena_alloc(ndx->arena, sizeof(uint64_t) * mem);
+	ndx->cmd = (byte*)midi_arena_alloc(ndx->arena, mem);
+	ndx->chan = (byte*)midi_arena_alloc(ndx->arena, mem);
+	ndx->note = (byte*)midi_arena_alloc(ndx->arena, mem);
+	ndx->value = (uint32_t*)midi_arena_alloc(ndx->arena, sizeof(uint32_t) * mem);
+	return ndx->time && ndx->cmd && ndx->chan && ndx->note && ndx->value;
+}
 
+// free the columns, but not the index itself
+void index_free_columns(MIDIEventIndex *ndx) {
 
-// output all queue elements which are at the oldest time or at most "delaymin" later
-void pull_queue(MIDIFile *midi) {
+	midi_arena_drop(ndx->arena, ndx->time);
+	midi_arena_drop(ndx->arena, ndx->cmd);
+	midi_arena_drop(ndx->arena, ndx->chan);
+	midi_arena_drop(ndx->arena, ndx->note);
+	midi_arena_drop(ndx->arena, ndx->value);
+}
 
-	#ifdef DEBUG
-	printf("EN    <-pull from queue at %lu.%03lu msec\n", midi->output_usec / 1000, midi->output_usec % 1000);
-	#endif
+void midi_free_index(MIDIFile *midi) {
 
-	uint64_t oldtime = midi->queue[midi->queue_oldest_ndx].note.time_usec; // the oldest time
-	assert(oldtime >= midi->output_usec); //, "oldest queue entry goes backward in pull_queue"
+	if (!midi->index) return;
 
-	uint64_t delta_usec = (oldtime - midi->output_usec) + midi->output_deficit_usec;
-	uint64_t delta_msec = delta_usec / 1000;
-	midi->output_deficit_usec = delta_usec % 1000;
+	index_free_columns(midi->index);
+	midi_arena_drop(midi->arena, midi->index);
+	midi->index = NULL;
+}
 
-	if (delta_usec > 0) { // if time has advanced beyond the merge threshold, output a delay
-		
-		if (delta_msec > 0) {
-			generate_delay(midi, delta_msec);
-
-			#ifdef DEBUG
-			printf("EN      at %lu.%03lu msec, delay for %ld msec to %lu.%03lu msec; deficit is %lu usec\n",
-				omidi->utput_usec / 1000, midi->output_usec % 1000, delta_msec,
-				oldtime / 1000, oldtime % 1000, midi->output_deficit_usec);
-			#endif
-		}
 
-		#ifdef DEBUG
-		printf("EN      at %lu.%03lu msec, a delay of only %lu usec was skipped, and the deficit is now %lu usec\n",
-	        midi->output_usec / 1000, midi->output_usec % 1000, oldtime - midi->output_usec, midi->output_deficit_usec);
-		#endif
-		midi->output_usec = oldtime;
-	}
+/*
+	The tracks have nothing to do with each other until they are merged, so they can be decoded
+	on separate threads. Each track goes into an index of its own, handed out biggest first from
+	a shared counter, and these are then copied one after the other into midi->index.
+*/
 
-	do {  // output and remove all entries at the same (oldest) time in the queue
-		// or which are only delaymin newer
-		remove_queue_entry(midi, midi->queue_oldest_ndx);
+typedef struct index_job IndexJob;
+struct index_job {
 
-		if (++midi->queue_oldest_ndx >= QUEUE_SIZE) midi->queue_oldest_ndx = 0;
-		--midi->queue_numitems;
-	} while(midi->queue_numitems > 0 && midi->queue[midi->queue_oldest_ndx].note.time_usec <= oldtime);
+	MIDIFile 		*midi;
+	MIDIEventIndex 	*tracks;		// one for each track
+	int 			*order;			// track numbers, longest first
+	int 			next;			// the next place in order to hand out
+	int 			failed;
+	const char 		**errors;		// why each track couldn't be decoded, or NULL
+};
 
-	/*// do any "stop notes" still needed to be generated?
-	for (int tgnum = 0; tgnum < num_tonegens; ++tgnum) {
+void *index_worker(void *arg) {
 
-	    struct tonegen_status *tg = &tonegen[tgnum];
-	    if (tg->stopnote_pending) { // got one
-	        last_output_was_delay = false;
-	        if (binaryoutput) {
-	            putc(CMD_STOPNOTE | tgnum, outfile);
-	            outfile_bytecount += 1;
-	        }
-	        else {
-	            fprintf(outfile, "0x%02X, ", CMD_STOPNOTE | tgnum);
-	            outfile_items(1);
-	        }
-	        if (loggen) fprintf(logfile, "      stop tgen %d %s\n", tgnum, describe(&tg->note));
-	        tg->stopnote_pending = false;
-	        tg->playing = false;
-	    }
+	IndexJob *job = (IndexJob*)arg;
+
+	while (1) {
+		int next = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (next >= job->midi->num_tracks) break;
+
+		int tracknum = job->order[next];
+		job->errors[tracknum] = index_track(job->midi, &job->tracks[tracknum], tracknum);
+		if (job->errors[tracknum])
+			__atomic_store_n(&job->failed, True, __ATOMIC_RELAXED);
 	}
-	*/
+	return NULL;
 }
 
+/// midi_build_index, decoding the tracks on num_threads threads (0 for one per processor)
+int midi_build_index_threads(MIDIFile *midi, int num_threads) {
 
-void flush_queue(MIDIFile *midi) { // empty the queue
+	if (num_threads <= 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads == 1)
+		return midi_build_index(midi);
 
-	while (midi->queue_numitems > 0)
-		pull_queue();
-}
+	midi_free_index(midi);
+	if (!midi_process_file_header(midi))
+		return False;
+	int num_tracks = midi->num_tracks;
+	if (num_threads > num_tracks) num_threads = num_tracks;
+
+	IndexJob job;
+	job.midi = midi;
+	job.tracks = (MIDIEventIndex*)calloc(sizeof(MIDIEventIndex), num_tracks + 1);
+	job.order = (int*)malloc(sizeof(int) * (num_tracks + 1));
+	job.errors = (const char**)calloc(sizeof(const char*), num_tracks + 1);
+	job.next = 0;
+	job.failed = False;
+	if (!job.tracks || !job.order || !job.errors) {
+		free(job.tracks);
+		free(job.order);
+		free(job.errors);
+		return midi_fail(midi, "out of memory");
+	}
+
+	// the headers are quick, and must be done in order since each is found from the one before
+	for (int tracknum = 0; tracknum < num_tracks; ++tracknum) {
+		if (!midi_process_track_header(midi, tracknum)) job.failed = True;
+		job.order[tracknum] = tracknum;
+	}
+	for (int i = 1; i < num_tracks; ++i) { // longest first; there aren't many
+		int tracknum = job.order[i], j = i;
+		long len = midi->track[tracknum].trkend - midi->track[tracknum].trkptr;
+		for (; j > 0; --j) {
+			int prev = job.order[j - 1];
+			if (midi->track[prev].trkend - midi->track[prev].trkptr >= len) break;
+			job.order[j] = prev;
+		}
+		job.order[j] = tracknum;
+	}
 
+	// the calling thread is one of the workers
+	int started = 1;
+	pthread_t threads[MAX_TRACKS];
+	if (!job.failed) {
+		for (; started < num_threads; ++started) {
+			if (pthread_create(&threads[started], NULL, index_worker, &job) != 0) break;
+		}
+		index_worker(&job);
+		for (int t = 1; t < started; ++t) pthread_join(threads[t], NULL);
+	}
 
-void midi_process_track_data(MIDIFile *midi) {
+	if (!job.failed) { // put the tracks together
+		int num_events = 0;
+		for (int tracknum = 0; tracknum < num_tracks; ++tracknum)
+			num_events += job.tracks[tracknum].num_events;
 
-	unsigned long last_earliest_time = 0;
-	int result;
+		MIDIEventIndex *ndx = midi->index = index_new(midi);
+		if (!ndx || !index_alloc_columns(ndx, num_events ? num_events : 1)) {
+			midi_free_index(midi);
+			midi_fail(midi, "out of memory");
+			job.failed = True;
+		}
+		else {
+			for (int tracknum = 0; tracknum < num_tracks; ++tracknum) {
+				MIDIEventIndex *trk = &job.tracks[tracknum];
+				int e = ndx->track_start[tracknum] = ndx->num_events;
+
+				memcpy(ndx->time + e, trk->time, sizeof(uint64_t) * trk->num_events);
+				memcpy(ndx->cmd + e, trk->cmd, trk->num_events);
+				memcpy(ndx->chan + e, trk->chan, trk->num_events);
+				memcpy(ndx->note + e, trk->note, trk->num_events);
+				memcpy(ndx->value + e, trk->value, sizeof(uint32_t) * trk->num_events);
+				ndx->num_events += trk->num_events;
+			}
+			ndx->track_start[num_tracks] = ndx->num_events;
+		}
+	}
 
-	do { // while there are still track notes to process
+	for (int tracknum = 0; tracknum < num_tracks; ++tracknum) {
+		if (job.errors[tracknum]) midi_fail(midi, job.errors[tracknum]); // the first track's reason
+		index_free_columns(&job.tracks[tracknum]);
+	}
+	free(job.tracks);
+	free(job.order);
+	free(job.errors);
 
-		/*
-		    Find the track with the earliest event time, and process it's event.
+	return !job.failed;
+}
 
-		    A potential improvement: If there are multiple tracks with the same time,
-		    first do the ones with STOPNOTE as the next command, if any.  That would
-		    help avoid running out of tone generators.  In practice, though, most MIDI
-		    files do all the STOPNOTEs first anyway, so it won't have much effect.
+/// midi_find_next_note, taking the events from midi->index
+int midi_index_next_note(MIDIFile *midi, int tracknum) {
+
+	MIDIEventIndex *ndx = midi->index;
+	TrackStatus *t = &midi->track[tracknum];
+	int end = ndx->track_start[tracknum + 1];
+
+	while (t->event < end) {
+
+		int e = t->event++;
+		byte chan = ndx->chan[e];
+		t->time = ndx->time[e];
+		t->chan = chan;
+
+		switch (ndx->cmd[e]) {
+
+		case CMD_TEMPO:
+			t->cmd = CMD_TEMPO;
+			t->tempo = ndx->value[e];
+			return True;
+		case CMD_STOPNOTE:
+			t->note = ndx->note[e];
+			t->volume = ndx->value[e];
+			if (midi_note_off(midi, t, chan)) return True;
+			break;
+		case CMD_PLAYNOTE:
+			t->note = ndx->note[e];
+			t->volume = ndx->value[e];
+			if (midi_want_channel(midi, chan)) {
+				t->chan = 0; // force all notes to channel 0, as when parsing
+				t->cmd = CMD_PLAYNOTE;
+				return True;
+			}
+			break;
+		case CMD_PED0:
+		case CMD_PED1:
+		case CMD_PED2:
+			t->cmd = ndx->cmd[e];
+			t->pedalVals[t->cmd == CMD_PED0 ? 0 : t->cmd == CMD_PED1 ? 1 : 2] = ndx->value[e];
+			t->volume = ndx->value[e];
+			return True;
+		case CMD_INSTRUMENT:
+			midi->channel[chan].instrument = ndx->value[e];
+			break;
+		}
+	}
+	t->cmd = CMD_TRACKDONE;
+	++midi->tracks_done;
+	return True;
+}
 
-		    Usually we start with the track after the one we did last time (tracknum),
-		    so that if we run out of tone generators, we have been fair to all the tracks.
-		    The alternate "strategy1" says we always start with track 0, which means
-		    that we favor early tracks over later ones when there aren't enough tone generators.
-		*/
+// move a track on to its next event, from the index if there is one
+int midi_track_next(MIDIFile *midi, int tracknum) {
 
-		TrackStatus *trk;
-		int count_tracks = midi->num_tracks;
-		uint64_t earliest_time = 0x7fffffff; // in ticks, of course
-		int tracknum = 0;
-		int earliest_tracknum;
+	if (midi->index)
+		return midi_index_next_note(midi, tracknum);
+	return midi_find_next_note(midi, tracknum);
+}
 
-		//if (strategy1) tracknum = num_tracks;      /* beyond the end, so we start with track 0 */
+char *describe(NoteInfo *np, char *notedescription) { // create a description of a note in a DESCRIBE_LEN buffer
 
-		do {
-			if (++tracknum >= midi->num_tracks) tracknum = 0;
+	snprintf(notedescription, DESCRIBE_LEN, "at %lu.%03lu msec, note %d (0x%02X) track %d channel %d volume %d instrument %d",
+	        np->time_usec / 1000, np->time_usec % 1000, np->note, np->note,
+	        np->track, np->channel, np->volume, np->instrument);
 
-			trk = &midi->track[tracknum];
+	return notedescription;
+}
 
-			if (trk->cmd != CMD_TRACKDONE && trk->time < earliest_time) {
-				earliest_time = trk->time;
-				earliest_tracknum = tracknum;
-			}
-		} while (--count_tracks);
 
-		tracknum = earliest_tracknum;  /* the track we picked */
-		trk = &midi->track[tracknum];
-		assert(earliest_time >= midi->timenow_ticks); // "time went backwards in process_track_data"
+/************** output reorder queue ******************
 
+We queue commands to be issued at arbitrary times and output them in time order. The queue is
+a binary min-heap on (time, seq) that grows as needed, where seq counts the queued commands so
+those for the same time come out in the order they were queued.
 
-		midi->timenow_ticks = earliest_time; // we make it the global time
-		midi->timenow_usec += (uint64_t)(midi->timenow_ticks - midi->timenow_usec_updated) * midi->tempo / midi->ticks_per_beat;
-		midi->timenow_usec_updated = midi->timenow_ticks;  // usec version is updated based on the current tempo
+midi_process_track_data pulls everything older than any command still to come, so the queue
+only holds what is within the release time of "now": nothing has to be output early to make
+room, and no event gets delayed. To show what that buys, the old fixed QUEUE_SIZE-entry queue is
+shadowed with just its timestamps, counting the events it would have delayed.
+*/
 
-		#ifdef DEBUG
-		if (earliest_time != last_earliest_time) {
-			printf("EN ->process trk %d at time %lu.%03lu msec (%lu ticks)\n", tracknum, midi->timenow_usec / 1000, midi->timenow_usec % 1000, midi->timenow_ticks);
-			last_earliest_time = earliest_time;
-		}
-		#endif
+// does queue entry a come out before b?
+int queue_before(QEntry *a, QEntry *b) {
 
-		ChannelStatus *cp = &midi->channel[trk->chan];  // the channel info, if play or stop
+	if (a->note.time_usec != b->note.time_usec) return a->note.time_usec < b->note.time_usec;
+	return a->seq < b->seq;
+}
 
+// add a time to the shadow of the old fixed queue; returns True if it would have been delayed
+int queue_shadow_push(MIDIFile *midi, timestamp time_usec) {
 
-		if (trk->cmd == CMD_TEMPO) { // change the global tempo, which affects future usec computations
+	timestamp *heap = midi->shadow_queue;
+	int ndx;
 
-			if (midi->tempo != trk->tempo) {
-				midi->tempo = trk->tempo;
+	if (midi->shadow_numitems == QUEUE_SIZE) { // full: the old queue output all of its oldest entries
+
+		timestamp oldtime = heap[0];
+		while (midi->shadow_numitems > 0 && heap[0] <= oldtime) {
+			timestamp last = heap[--midi->shadow_numitems];
+			ndx = 0;
+			while (1) {
+				int child = 2 * ndx + 1;
+				if (child >= midi->shadow_numitems) break;
+				if (child + 1 < midi->shadow_numitems && heap[child + 1] < heap[child]) ++child;
+				if (heap[child] >= last) break;
+				heap[ndx] = heap[child];
+				ndx = child;
 			}
+			heap[ndx] = last;
+		}
+		// its horizon included the deficit, which was always the time's leftover usec
+		midi->shadow_horizon = oldtime + oldtime % 1000;
+	}
 
-			#ifdef DEBUG
-			printf("EN  tempo set to %ld usec/qnote\n", midi->tempo);
-			#endif
+	int delayed = time_usec < midi->shadow_horizon;
+	if (delayed) time_usec = midi->shadow_horizon;
 
-			result = midi_find_next_note(midi, tracknum); assert(result == True);
-		}
-		else if (trk->cmd == CMD_STOPNOTE) {
+	ndx = midi->shadow_numitems++;
+	while (ndx > 0 && heap[(ndx - 1) / 2] > time_usec) {
+		heap[ndx] = heap[(ndx - 1) / 2];
+		ndx = (ndx - 1) / 2;
+	}
+	heap[ndx] = time_usec;
 
-			int ndx;  // find the noteinfo for this note -- which better be playing -- in the channel status
-			for (ndx = 0; ndx < MAX_CHANNELNOTES; ++ndx) {
-				if (cp->note_playing[ndx] && cp->notes_playing[ndx].note == trk->note && cp->notes_playing[ndx].track == tracknum)
-					break;
-			}
-			if (ndx >= MAX_CHANNELNOTES) { // channel not found... presumably the array overflowed on input
+	return delayed;
+}
 
-				#ifdef DEBUG
-				printf("EN  *** noteinfo slot not found to stop track %d note %d (%02X) channel %d\n", tracknum, trk->note, trk->note, trk->chan);
-				#endif
-			}
-			else { // we found the channel that was paying this note...
-
-				// Analyze the sustain and release parameters. We might generate another "note on"
-				// command with reduced volume, and/or move the stopnote command earlier than now.
-				NoteInfo *np = &cp->notes_playing[ndx];
-				unsigned long duration_usec = midi->timenow_usec - np->time_usec; // it has the start time in it
-				unsigned long truncation;
-				if (duration_usec <= notemin_usec) truncation = 0;
-				else if (duration_usec < releasetime_usec + notemin_usec) truncation = duration_usec - notemin_usec;
-				else truncation = releasetime_usec;
-
-				// NOT SURE WHAT IS GOING ON HERE! BUT IT SEEMS TO WORK
-				np->time_usec = midi->timenow_usec - truncation; // adjust time to be when the note stops
-				queue_cmd(midi, CMD_STOPNOTE, np);
-				cp->note_playing[ndx] = false;
-			}
-			result = midi_find_next_note(midi, tracknum); assert(result == True);
-		}
-		else if (trk->cmd == CMD_PLAYNOTE) { // Process only one "start note", so other tracks get a chance at tone generators
+// queue a "note on" or "note off" command; False if there's no memory for it
+int queue_cmd(MIDIFile *midi, byte cmd, NoteInfo *np) {
 
-			int ndx;  // find an unused noteinfo slot to use
-			for (ndx = 0; ndx < MAX_CHANNELNOTES; ++ndx) {
-				if (!cp->note_playing[ndx])
-					break;
-			}
+	MIDI_STAGE(midi, STAGE_QUEUE);
+	MIDI_TRACE(midi, TRACE_QUEUE, cmd, np->track, np->channel, np->note, np->volume, np->time_usec);
 
-			if (ndx >= MAX_CHANNELNOTES) {
-
-				#ifdef DEBUG
-				printf("EN  *** no noteinfo slot to queue track %d note %d (%02X) channel %d\n", tracknum, trk->note, trk->note, trk->chan);
-				#endif
-
-				//show_noteinfo_slots(tracknum);
-			} else {
-				cp->note_playing[ndx] = true;  // assign it to us
-				NoteInfo *pn = &cp->notes_playing[ndx];
-				pn->time_usec = midi->timenow_usec; // fill it in
-				pn->track = tracknum;
-				pn->channel = trk->chan;
-				pn->note = trk->note;
-				pn->instrument = cp->instrument;
-				pn->volume = trk->volume;
-				queue_cmd(midi, CMD_PLAYNOTE, pn);
-			}
-			result = midi_find_next_note(midi, tracknum); assert(result == True);
-		}
-		else if (trk->cmd == CMD_PED0) { // PEDAL 0 -- ADDED BY FELIX
-			//pedalStatus[0] = trk->pedalVals[0];
-			pedalNote.volume = pedalStatus[0];
-			pedalNote.time_usec = midi->timenow_usec;
-			queue_cmd(midi, CMD_PED0, &pedalNote);
-			result = midi_find_next_note(midi, tracknum); assert(result == True);
-		}
-		else if (trk->cmd == CMD_PED1) { // PEDAL 0 -- ADDED BY FELIX
-			pedalStatus[1] = trk->pedalVals[1];
-			pedalNote.volume = pedalStatus[1];
-			pedalNote.time_usec = midi->timenow_usec;
-			queue_cmd(midi, CMD_PED1, &pedalNote);
-			result = midi_find_next_note(midi, tracknum); assert(result == True);
-		}
-		else if (trk->cmd == CMD_PED2) { // PEDAL 0 -- ADDED BY FELIX
-			pedalStatus[2] = trk->pedalVals[2];
-			pedalNote.volume = midi->pedalStatus[2];
-			pedalNote.time_usec = timenow_usec;
-			queue_cmd(midi, CMD_PED2, &pedalNote);
-			result = midi_find_next_note(midi, tracknum); assert(result == True);
-		}
-		else {
-			printf("BAD CMD in process_track_data"); assert(False);
-		}
+	if (queue_shadow_push(midi, np->time_usec))
+		++midi->events_would_delay;
 
-	} while (midi->tracks_done < num_tracks);
+	if (np->time_usec < midi->output_usec) { // don't allow revisionist history; this can't happen
+		MIDI_TRACE(midi, TRACE_QUEUE_DELAYED, cmd, np->track, np->channel, np->note, midi->output_usec - np->time_usec, np->time_usec);
 
-	printf("loop done, now flushing...\n");
+		np->time_usec = midi->output_usec;
+		++midi->events_delayed;
+	}
 
-	// empty the output queue and generate the end-of-score command
-	flush_queue();
+	if (midi->queue_numitems == midi->queue_mem) {
+		int mem = midi->queue_mem ? 2 * midi->queue_mem : QUEUE_SIZE;
+		QEntry *queue = (QEntry*)realloc(midi->queue, sizeof(QEntry) * mem);
+		if (!queue) return midi_fail(midi, "out of memory");
+		midi->queue = queue;
+		midi->queue_mem = mem;
+	}
 
+	QEntry entry;
+	entry.cmd = cmd;
+	entry.note = *np;  // structure copy of the note
+	entry.seq = midi->queue_seq++;
 
-	#ifdef DEBUG
-	printf("EN ending timenow_usec: %lu.%03lu\n", midi->timenow_usec / 1000, midi->timenow_usec % 1000);
-	printf("EN ending output_usec:  %lu.%03lu\n", midi->output_usec / 1000, midi->output_usec % 1000);
-	#endif
+	int ndx = midi->queue_numitems++;
+	while (ndx > 0) { // move it up in front of anything that comes out later
+		int parent = (ndx - 1) / 2;
+		if (!queue_before(&entry, &midi->queue[parent])) break;
 
-	assert(midi->timenow_usec >= midi->output_usec); // "time deficit at end of song"
-	generate_delay(midi, (midi->timenow_usec - midi->output_usec) / 1000);
+		midi->queue[ndx] = midi->queue[parent];
+		ndx = parent;
+	}
+	midi->queue[ndx] = entry;
 
-	midi_writeoutput(midi, CMD_STOP);
+	if (midi->queue_numitems > midi->queue_highwater)
+		midi->queue_highwater = midi->queue_numitems;
+	MIDI_STAGE(midi, STAGE_MERGE);
+	return True;
 }
 
+// take the oldest entry off the queue
+void queue_pop(MIDIFile *midi, QEntry *entry) {
 
+	QEntry *heap = midi->queue;
+	*entry = heap[0];
 
-int midi_binarize( const char* midifile, const char* outfile) {
+	QEntry last = heap[--midi->queue_numitems];
+	int ndx = 0;
+	while (1) {
+		int child = 2 * ndx + 1;
+		if (child >= midi->queue_numitems) break;
+		if (child + 1 < midi->queue_numitems && queue_before(&heap[child + 1], &heap[child]))
+			++child;
+		if (!queue_before(&heap[child], &last)) break;
 
-	int result;
+		heap[ndx] = heap[child];
+		ndx = child;
+	}
+	heap[ndx] = last;
+}
 
-	MIDIFile *midi = midi_load(midifile);
-	result = midi_process_file_header(midi); assert(result == True);
+/************** tone generators ******************
+
+	If options.num_tonegens is set, each note is assigned to a tone generator as it is output, the
+	way org.c does it: a note played again while it's still playing stays on its generator; next,
+	with options.tonegen_per_track, comes the generator the track used last, if it's free; then a
+	free generator last set to the same instrument; then any free one. If none is free the note
+	is skipped, along with its stop.
+
+	Rather than scanning the generators for each of those, every question is a bit mask, and the
+	answer is the lowest bit set: tonegen_free has the generators not playing, tonegen_instrument
+	the ones last set to each instrument, and tonegen_playing the ones playing each note of each
+	channel, which also finds the generator to stop.
+*/
+
+void tonegen_reset(MIDIFile *midi) {
+
+	int num = midi->options.num_tonegens;
+	if (num > MAX_TONEGENS) num = MAX_TONEGENS;
+	if (num < 0) num = 0; // not assigned, as for 0
+
+	memset(midi->tonegen, 0, sizeof(midi->tonegen));
+	memset(midi->tonegen_instrument, 0, sizeof(midi->tonegen_instrument));
+	memset(midi->tonegen_playing, 0, sizeof(midi->tonegen_playing));
+	midi->tonegen_free = (uint16_t)((1u << num) - 1);
+	midi->tonegen_instrument[0] = midi->tonegen_free; // they all start out on instrument 0
+	for (int tracknum = 0; tracknum < MAX_TRACKS; ++tracknum)
+		midi->track[tracknum].preferred_tonegen = 0;
+
+	midi->tonegens_used = 0;
+	midi->notes_skipped = 0;
+	midi->instrument_changes = 0;
+	midi->playnotes_without_stopnotes = 0;
+	midi->stopnotes_without_playnotes = 0;
+}
 
-	// initialize for processing of all the tracks
-	midi->tempo = DEFAULT_TEMPO;
-	midi->tracks_done = 0;
+// assign a note that is starting to a tone generator; returns -1 if they are all busy
+int tonegen_play(MIDIFile *midi, NoteInfo *np) {
 
-	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
+	int note = np->note & 0x7f, instrument = np->instrument & (NUM_INSTRUMENTS - 1);
+	uint16_t *playing = &midi->tonegen_playing[np->channel & (NUM_CHANNELS - 1)][note];
+	int tgnum;
 
-		midi->track[tracknum].tempo = DEFAULT_TEMPO;
-		midi_process_track_header(midi, tracknum);
+	if (*playing) { // this must be the start of the sustain phase of a playing note
+		tgnum = __builtin_ctz(*playing);
+		++midi->playnotes_without_stopnotes;
+	}
+	else {
+		uint16_t free = midi->tonegen_free;
+		if (!free) {
+			MIDI_TRACE(midi, TRACE_NO_TONEGEN, CMD_PLAYNOTE, np->track, np->channel, np->note, np->volume, np->time_usec);
+			++midi->notes_skipped;
+			return -1;
+		}
+
+		int preferred = midi->track[np->track].preferred_tonegen;
+		uint16_t same = free & midi->tonegen_instrument[instrument];
+		if (midi->options.tonegen_per_track && (free & (1u << preferred))) tgnum = preferred;
+		else tgnum = __builtin_ctz(same ? same : free);
 
-		result = midi_find_next_note(midi, tracknum);     /* position to the first note on/off */
-		assert(result == True);
+		midi->tonegen_free &= ~(1u << tgnum);
+		*playing |= 1u << tgnum;
 	}
 
-	midi->queue_numitems = 0;
-	midi->queue_oldest_ndx = 0;
-	midi->queue_newest_ndx = 0;
-	midi->debugcount = 0;
+	ToneGen *tg = &midi->tonegen[tgnum];
+	if (tg->instrument != instrument) { // it's a new instrument for this generator
+		midi->tonegen_instrument[tg->instrument] &= ~(1u << tgnum);
+		midi->tonegen_instrument[instrument] |= 1u << tgnum;
+		tg->instrument = instrument;
+		++midi->instrument_changes;
+	}
+	tg->channel = np->channel;
+	tg->note = note;
 
-	midi->last_output_was_delay = false;
+	midi->track[np->track].preferred_tonegen = tgnum;
+	if (tgnum + 1 > midi->tonegens_used) midi->tonegens_used = tgnum + 1;
+	return tgnum;
+}
 
-	midi->output_len = 0;
-	midi->output_mem = 512;
-	midi->output = (byte*)calloc(sizeof(byte), midi->output_mem);
+// free the tone generator playing a note that is stopping; returns -1 if none is
+int tonegen_stop(MIDIFile *midi, NoteInfo *np) {
 
+	uint16_t *playing = &midi->tonegen_playing[np->channel & (NUM_CHANNELS - 1)][np->note & 0x7f];
+	if (!*playing) { // presumably it never started, because there weren't any free tone generators
+		++midi->stopnotes_without_playnotes;
+		return -1;
+	}
 
-	midi->timenow_ticks = 0;
-	midi->timenow_usec = 0;
-	midi->timenow_usec_updated = 0;
-	midi->output_usec = 0;
-	midi->output_deficit_usec = 0;
-	midi_process_track_data(midi);    // do all the tracks interleaved, like a 1950's multiway merge
+	int tgnum = __builtin_ctz(*playing);
+	*playing &= ~(1u << tgnum);
+	midi->tonegen_free |= 1u << tgnum;
+	return tgnum;
+}
 
 
+// the tone generator a queue entry being output goes to, 0 if they aren't being assigned; -1 to skip it
+int queue_entry_tonegen(MIDIFile *midi, QEntry *q) {
 
+	if (midi->options.num_tonegens > 0 && (q->cmd == CMD_PLAYNOTE || q->cmd == CMD_STOPNOTE))
+		return q->cmd == CMD_PLAYNOTE ? tonegen_play(midi, &q->note) : tonegen_stop(midi, &q->note);
+	return 0;
+}
+
+// describe an output command as a MIDIEvent
+void queue_entry_event(QEntry *q, int tgnum, MIDIEvent *ev) {
+
+	ev->time_usec = q->note.time_usec;
+	ev->track = q->note.track;
+	ev->channel = q->note.channel;
+	ev->note = q->note.note;
+	ev->instrument = q->note.instrument;
+	ev->volume = q->note.volume;
+	ev->cmd = q->cmd;
+	ev->tonegen = (byte)tgnum;
+	memset(ev->unused, 0, sizeof(ev->unused));
+}
+
+// keep a copy of an output command in midi->events; False if there's no memory for it
+int queue_collect_event(MIDIFile *midi, QEntry *q, int tgnum) {
+
+	if (midi->num_events == midi->events_mem) {
+		uint32_t mem = midi->events_mem ? 2 * midi->events_mem : 1024;
+		MIDIEvent *events = (MIDIEvent*)realloc(midi->events, sizeof(MIDIEvent) * mem);
+		if (!events) return midi_fail(midi, "out of memory");
+		midi->events = events;
+		midi->events_mem = mem;
+	}
+	queue_entry_event(q, tgnum, &midi->events[midi->num_events++]);
+	return True;
+}
+
+// output a queue entry, on the tone generator it is assigned to if they are being assigned;
+// False if there's no memory for it
+int remove_queue_entry(MIDIFile *midi, QEntry *q) {
+
+	MIDI_TRACE(midi, TRACE_OUTPUT, q->cmd, q->note.track, q->note.channel, q->note.note, q->note.volume, q->note.time_usec);
+
+	int tgnum = queue_entry_tonegen(midi, q);
+	if (tgnum < 0) return True; // skipped
+	midi->last_output_was_delay = false;
+	++midi->commands_output;
+
+	if (midi->collect_events && !queue_collect_event(midi, q, tgnum))
+		return False;
+
+	if (q->cmd == CMD_STOPNOTE) {
+
+		byte msg[2] = { (byte)(CMD_STOPNOTE | tgnum), q->note.note };
+		return midi_writeoutput_bytes(midi, msg, 2);
+	}
+	else if (q->cmd == CMD_PLAYNOTE) {
+
+		byte msg[3] = { (byte)(CMD_PLAYNOTE | tgnum), q->note.note, q->note.volume };
+		return midi_writeoutput_bytes(midi, msg, 3);
+	}
+	else if (q->cmd == CMD_PED0 || q->cmd == CMD_PED1 || q->cmd == CMD_PED2) { // PEDALS- ADDED BY FELIX
+
+		byte msg[2] = { q->cmd, q->note.volume };
+		return midi_writeoutput_bytes(midi, msg, 2);
+	}
+	else {
+		printf("BAD CMD in remove_queue_entry"); assert(False);
+	}
+	return True;
+}
+
+/*
+	In the compact format a delay of up to DELAY_SHORT_MAX msec takes one byte, and a longer one
+	two, as in the classic format but with a bit less range. Delays too long for one command are
+	split into several. Delays that come right after one another, as when all the notes at a
+	time were skipped for want of tone generators, are added together into one if the first is
+	still in the output buffer.
+*/
+
+// output a delay command in the compact format
+int generate_delay_compact(MIDIFile *midi, uint64_t delta_msec) {
+
+	if (delta_msec == 0) return True;
+
+	MIDI_TRACE(midi, TRACE_DELAY, 0, 0, 0, 0, delta_msec, midi->output_usec);
+
+	uint64_t start = midi->output_flushed + midi->output_len;
+	if (midi->last_output_was_delay && midi->delay_start >= midi->output_flushed) { // replace it with the sum
+		start = midi->delay_start;
+		midi->output_len = start - midi->output_flushed;
+		delta_msec += midi->delay_msec;
+		++midi->delays_merged;
+	}
+	else ++midi->delays_output;
+	midi->last_output_was_delay = true;
+	midi->delay_start = start;
+	midi->delay_msec = delta_msec;
+
+	while (delta_msec > DELAY_COMPACT_MAX) { // more than a delay can hold: several in a row
+		byte msg[2] = { DELAY_COMPACT_MAX >> 8, DELAY_COMPACT_MAX & 0xff };
+		if (!midi_writeoutput_bytes(midi, msg, 2)) return False;
+		delta_msec -= DELAY_COMPACT_MAX;
+	}
+
+	if (delta_msec > DELAY_SHORT_MAX) {
+		byte msg[2] = { (byte)(delta_msec >> 8), (byte)(delta_msec & 0xff) };
+		return midi_writeoutput_bytes(midi, msg, 2);
+	}
+	else if (delta_msec > 0) {
+		return midi_writeoutput(midi, (byte)(DELAY_SHORT | delta_msec));
+	}
+	return True;
+}
+
+// output the header of the compact format
+int generate_output_header(MIDIFile *midi) {
+
+	MIDIOutputHeader hdr = { 'P', 't', sizeof(MIDIOutputHeader), HDR_F1_VOLUME_PRESENT, 0, 1, MIDI_FORMAT_COMPACT };
+	if (!midi->options.percussion_ignore) hdr.f1 |= HDR_F1_PERCUSSION_PRESENT;
+	if (midi->options.num_tonegens > 0)
+		hdr.num_tgens = midi->options.num_tonegens < MAX_TONEGENS ? midi->options.num_tonegens : MAX_TONEGENS;
+
+	return midi_writeoutput_bytes(midi, (const byte*)&hdr, sizeof(hdr));
+}
+
+// output a delay command; False if there's no memory for it
+int generate_delay(MIDIFile *midi, uint64_t delta_msec) {
+
+	if (midi->options.output_format == MIDI_FORMAT_COMPACT)
+		return generate_delay_compact(midi, delta_msec);
+
+	while (delta_msec > DELAY_CLASSIC_MAX) { // more than a delay can hold: several in a row
+		if (!generate_delay(midi, DELAY_CLASSIC_MAX)) return False;
+		delta_msec -= DELAY_CLASSIC_MAX;
+	}
+
+	if (delta_msec > 0) {
+
+		MIDI_TRACE(midi, TRACE_DELAY, 0, 0, 0, 0, delta_msec, midi->output_usec);
+		if (midi->last_output_was_delay) {
+			MIDI_TRACE(midi, TRACE_CONSECUTIVE_DELAY, 0, 0, 0, 0, delta_msec, midi->output_usec);
+			++midi->consecutive_delays;
+		}
+		midi->last_output_was_delay = true;
+		++midi->delays_output;
+
+		// output a 15-bit delay in big-endian format
+		byte msg[2] = { (byte)(delta_msec >> 8), (byte)(delta_msec & 0xff) };
+		return midi_writeoutput_bytes(midi, msg, 2);
+	}
+	return True;
+}
+
+
+
+
+// output all queue elements which are at the oldest time or at most "delaymin" later;
+// False if there's no memory for the output
+int pull_queue(MIDIFile *midi) {
+
+	MIDI_STAGE(midi, STAGE_OUTPUT);
+	uint64_t oldtime = midi->queue[0].note.time_usec; // the oldest time
+	assert(oldtime >= midi->output_usec); //, "oldest queue entry goes backward in pull_queue"
+
+	uint64_t delta_usec = (oldtime - midi->output_usec) + midi->output_deficit_usec;
+	uint64_t delta_msec = delta_usec / 1000;
+	midi->output_deficit_usec = delta_usec % 1000;
+
+	if (delta_usec > 0) { // if time has advanced beyond the merge threshold, output a delay
+		
+		if (delta_msec > 0 && !generate_delay(midi, delta_msec))
+			return False;
+		midi->output_usec = oldtime;
+	}
+	MIDI_TRACE(midi, TRACE_PULL, 0, 0, 0, 0, midi->output_deficit_usec, oldtime);
+
+	do {  // output and remove all entries at the same (oldest) time in the queue
+		// or which are only delaymin newer
+		QEntry q;
+		MIDI_STAGE(midi, STAGE_QUEUE);
+		queue_pop(midi, &q);
+		MIDI_STAGE(midi, STAGE_OUTPUT);
+		if (!remove_queue_entry(midi, &q)) return False;
+	} while(midi->queue_numitems > 0 && midi->queue[0].note.time_usec <= oldtime);
+
+	/*// do any "stop notes" still needed to be generated?
+	for (int tgnum = 0; tgnum < num_tonegens; ++tgnum) {
+
+	    struct tonegen_status *tg = &tonegen[tgnum];
+	    if (tg->stopnote_pending) { // got one
+	        last_output_was_delay = false;
+	        if (binaryoutput) {
+	            putc(CMD_STOPNOTE | tgnum, outfile);
+	            outfile_bytecount += 1;
+	        }
+	        else {
+	            fprintf(outfile, "0x%02X, ", CMD_STOPNOTE | tgnum);
+	            outfile_items(1);
+	        }
+	        if (loggen) fprintf(logfile, "      stop tgen %d %s\n", tgnum, describe(&tg->note));
+	        tg->stopnote_pending = false;
+	        tg->playing = false;
+	    }
+	}
+	*/
+	return True;
+}
+
+
+int flush_queue(MIDIFile *midi) { // empty the queue
+
+	while (midi->queue_numitems > 0)
+		if (!pull_queue(midi)) return False;
+	return True;
+}
+
+// output what no command still to come can precede: the earliest one can be is now, less the release time;
+// midi_next_event takes them from the queue itself
+int queue_pull_ready(MIDIFile *midi) {
+
+	if (midi->iterating || midi->queue_numitems == 0 || midi->queue[0].note.time_usec + midi->options.releasetime_usec >= midi->timenow_usec)
+		return True;
+	do if (!pull_queue(midi)) return False;
+	while (midi->queue_numitems > 0 && midi->queue[0].note.time_usec + midi->options.releasetime_usec < midi->timenow_usec);
+	MIDI_STAGE(midi, STAGE_MERGE);
+	return True;
+}
+
+
+/************** playing notes ******************
+
+	Each channel keeps the notes playing on it in slots, which grow as needed rather than topping
+	out at MAX_CHANNELNOTES, so dense scores don't lose notes. A start takes the lowest free slot,
+	found from the slot_busy bits; a stop finds its note through note_first, the chain of slots
+	playing each note number, which is nearly always one long. Slots are used in the same order
+	as the old fixed ones were, since the notes sounding at the ends of a window are queued in
+	slot order, and a note started twice on a track stops the lowest slot first, as before.
+*/
+
+void channel_reset(MIDIFile *midi) {
+
+	for (int chan = 0; chan < NUM_CHANNELS; ++chan) {
+		ChannelStatus *cp = &midi->channel[chan];
+		cp->instrument = 0;
+		if (cp->slot_busy) memset(cp->slot_busy, 0, sizeof(uint64_t) * (cp->num_slots / 64));
+		memset(cp->note_first, 0, sizeof(cp->note_first));
+		cp->num_playing = 0;
+	}
+	midi->notes_unmatched = 0;
+	midi->notes_playing_max = 0;
+	midi->notes_over_slots = 0;
+}
+
+// take a slot for a note starting on a track; the caller fills in the rest of the NoteInfo.
+// NULL, with the reason recorded, if there's no memory for more slots
+NoteInfo *channel_note_start(MIDIFile *midi, ChannelStatus *cp, int tracknum, int note) {
+
+	int word = 0, words = cp->num_slots / 64;
+	while (word < words && cp->slot_busy[word] == ~(uint64_t)0) ++word;
+
+	if (word == words) { // all in use: make more
+		int old = cp->num_slots, slots = old ? 2 * old : 64;
+		// each array is kept as soon as it has grown, so a failure leaves them all good for the old slots
+		NoteInfo *notes = (NoteInfo*)midi_arena_grow(midi->arena, cp->notes_playing,
+		                                             sizeof(NoteInfo) * old, sizeof(NoteInfo) * slots);
+		if (notes) cp->notes_playing = notes;
+		int *next = notes ? (int*)midi_arena_grow(midi->arena, cp->slot_next, sizeof(int) * old, sizeof(int) * slots) : NULL;
+		if (next) cp->slot_next = next;
+		uint64_t *busy = next ? (uint64_t*)midi_arena_grow(midi->arena, cp->slot_busy,
+		                                                   sizeof(uint64_t) * (old / 64), sizeof(uint64_t) * (slots / 64)) : NULL;
+		if (!busy) {
+			midi_fail(midi, "out of memory");
+			return NULL;
+		}
+		cp->slot_busy = busy;
+		cp->num_slots = slots;
+		memset(cp->slot_busy + words, 0, sizeof(uint64_t) * (cp->num_slots / 64 - words));
+	}
+
+	int slot = word * 64 + __builtin_ctzll(~cp->slot_busy[word]);
+	cp->slot_busy[word] |= (uint64_t)1 << (slot % 64);
+	cp->slot_next[slot] = cp->note_first[note & 0x7f];
+	cp->note_first[note & 0x7f] = slot + 1;
+
+	if (cp->num_playing >= MAX_CHANNELNOTES) ++midi->notes_over_slots;
+	if (++cp->num_playing > midi->notes_playing_max) midi->notes_playing_max = cp->num_playing;
+
+	NoteInfo *np = &cp->notes_playing[slot];
+	np->track = tracknum;
+	np->note = note;
+	return np;
+}
+
+// the slot of a note playing on a track, or -1 if it isn't
+int channel_note_find(ChannelStatus *cp, int tracknum, int note) {
+
+	int found = -1;
+	for (int next = cp->note_first[note & 0x7f]; next; next = cp->slot_next[next - 1]) {
+		NoteInfo *np = &cp->notes_playing[next - 1];
+		if (np->note == note && np->track == tracknum && (found < 0 || next - 1 < found))
+			found = next - 1;
+	}
+	return found;
+}
+
+// give back the slot of a note that has stopped
+void channel_note_stop(ChannelStatus *cp, int slot) {
+
+	int *link = &cp->note_first[cp->notes_playing[slot].note & 0x7f];
+	while (*link != slot + 1) link = &cp->slot_next[*link - 1];
+	*link = cp->slot_next[slot];
+
+	cp->slot_busy[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+	--cp->num_playing;
+}
+
+// the first slot in use at or after slot, or -1
+int channel_next_playing(ChannelStatus *cp, int slot) {
+
+	for (int word = slot / 64; word < cp->num_slots / 64; ++word) {
+		uint64_t busy = cp->slot_busy[word];
+		if (word == slot / 64) busy &= ~(uint64_t)0 << (slot % 64);
+		if (busy) return word * 64 + __builtin_ctzll(busy);
+	}
+	return -1;
+}
+
+
+/************** conversion window ******************
+
+options.start_usec and end_usec limit the conversion to a window of the score. The tracks are
+not played up to the start: each one jumps to its first event in the window with a binary search
+of the event index, and what its events before that leave behind (the notes still sounding, the
+pedals and the instruments) is worked out from the index columns alone, without going through
+the merge and the output queue. Those notes and pedals are then queued at the start of the
+window, as if played there. At the end of the window the notes still sounding are stopped.
+*/
+
+// the first of a track's events in the index at or after tick
+int seek_track_event(MIDIEventIndex *ndx, int tracknum, uint64_t tick) {
+
+	int lo = ndx->track_start[tracknum], hi = ndx->track_start[tracknum + 1];
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (ndx->time[mid] < tick) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// find what the events of a track up to end leave sounding, and the pedals they leave where;
+// False if there's no memory for the notes
+int seek_track_state(MIDIFile *midi, int tracknum, int end, int64_t *pedal_tick) {
+
+	MIDIEventIndex *ndx = midi->index;
+	ChannelStatus *cp = &midi->channel[0]; // the merge puts all the notes on channel 0
+
+	for (int e = ndx->track_start[tracknum]; e < end; ++e) {
+
+		byte cmd = ndx->cmd[e];
+
+		if (cmd == CMD_PLAYNOTE && midi_want_channel(midi, ndx->chan[e])) {
+			NoteInfo *pn = channel_note_start(midi, cp, tracknum, ndx->note[e]);
+			if (!pn) return False;
+			pn->channel = 0;
+			pn->instrument = cp->instrument;
+			pn->volume = ndx->value[e];
+		}
+		else if (cmd == CMD_STOPNOTE && midi_want_channel(midi, ndx->chan[e])) {
+			int slot = channel_note_find(cp, tracknum, ndx->note[e]);
+			if (slot >= 0) channel_note_stop(cp, slot);
+		}
+		else if (cmd == CMD_PED0 || cmd == CMD_PED1 || cmd == CMD_PED2) {
+			int pedal = cmd == CMD_PED0 ? 0 : cmd == CMD_PED1 ? 1 : 2;
+			if ((int64_t)ndx->time[e] >= pedal_tick[pedal]) { // the latest of all the tracks
+				pedal_tick[pedal] = ndx->time[e];
+				midi->pedalStatus[pedal] = ndx->value[e];
+			}
+		}
+		else if (cmd == CMD_INSTRUMENT) {
+			midi->channel[ndx->chan[e]].instrument = ndx->value[e];
+		}
+	}
+	return True;
+}
+
+/// Position the tracks at options.start_usec and queue the pedals and notes sounding there;
+/// False if there's no memory for them
+int midi_seek(MIDIFile *midi) {
+
+	MIDIEventIndex *ndx = midi->index;
+	uint64_t start_usec = midi->options.start_usec;
+	int64_t pedal_tick[3] = { -1, -1, -1 };
+
+	uint64_t start_tick = midi_tempo_map_ticks(&midi->tempo_map, start_usec);
+	if (midi_tempo_map_usec(&midi->tempo_map, start_tick) < start_usec) ++start_tick; // the first tick in the window
+
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
+
+		TrackStatus *t = &midi->track[tracknum];
+		t->event = seek_track_event(ndx, tracknum, start_tick);
+		if (!seek_track_state(midi, tracknum, t->event, pedal_tick)) return False;
+		midi_index_next_note(midi, tracknum);
+	}
+
+	midi->tempo = midi_tempo_map_tempo(&midi->tempo_map, start_tick);
+	midi->timenow_ticks = start_tick;
+	midi->timenow_usec = start_usec;
+	midi->output_usec = start_usec;
+
+	for (int pedal = 0; pedal < 3; ++pedal) {
+		if (pedal_tick[pedal] < 0) continue; // never set, so still as at the start
+		midi->pedalNote.volume = midi->pedalStatus[pedal];
+		midi->pedalNote.time_usec = start_usec;
+		if (!queue_cmd(midi, pedal == 0 ? CMD_PED0 : pedal == 1 ? CMD_PED1 : CMD_PED2, &midi->pedalNote))
+			return False;
+	}
+
+	ChannelStatus *cp = &midi->channel[0];
+	for (int slot = channel_next_playing(cp, 0); slot >= 0; slot = channel_next_playing(cp, slot + 1)) {
+		cp->notes_playing[slot].time_usec = start_usec; // as far as the output goes, it starts here
+		if (!queue_cmd(midi, CMD_PLAYNOTE, &cp->notes_playing[slot])) return False;
+	}
+	return True;
+}
+
+// stop the notes still sounding at options.end_usec
+int midi_seek_end(MIDIFile *midi) {
+
+	midi->timenow_usec = midi->options.end_usec;
+	if (!queue_pull_ready(midi)) return False;
+
+	for (int chan = 0; chan < NUM_CHANNELS; ++chan) {
+		ChannelStatus *cp = &midi->channel[chan];
+		for (int slot = channel_next_playing(cp, 0); slot >= 0; slot = channel_next_playing(cp, slot + 1)) {
+			cp->notes_playing[slot].time_usec = midi->timenow_usec;
+			if (!queue_cmd(midi, CMD_STOPNOTE, &cp->notes_playing[slot])) return False;
+			channel_note_stop(cp, slot);
+		}
+	}
+	return True;
+}
+
+/// Set the window in ticks rather than usec; this builds the tempo map, to convert them
+int midi_set_window_ticks(MIDIFile *midi, uint64_t start_tick, uint64_t end_tick) {
+
+	if (!midi->tempo_map.complete && !midi_build_tempo_map(midi))
+		return False;
+
+	midi->options.start_usec = midi_tempo_map_usec(&midi->tempo_map, start_tick);
+	midi->options.end_usec = end_tick ? midi_tempo_map_usec(&midi->tempo_map, end_tick) : 0;
+	return True;
+}
+
+
+/************** track merge heap ******************
+
+The unfinished tracks are kept in a binary min-heap ordered by the time, in ticks, of their
+next event, so picking the earliest track costs O(log tracks) instead of a scan of all of them.
+Ties are broken by merge_seq, which a track is given every time it takes a new place in the
+heap: tracks with events at the same time are then served round-robin.
+*/
+
+// is track a due before track b?
+int merge_heap_before(MIDIFile *midi, int a, int b) {
+
+	TrackStatus *ta = &midi->track[a];
+	TrackStatus *tb = &midi->track[b];
+
+	if (ta->time != tb->time) return ta->time < tb->time;
+	return ta->merge_seq < tb->merge_seq;
+}
+
+// move the entry at ndx down until its children are due after it
+void merge_heap_sift_down(MIDIFile *midi, int ndx) {
+
+	int *heap = midi->merge_heap;
+	int tracknum = heap[ndx];
+
+	while (1) {
+		int child = 2 * ndx + 1;
+		if (child >= midi->merge_heap_len) break;
+		if (child + 1 < midi->merge_heap_len && merge_heap_before(midi, heap[child + 1], heap[child]))
+			++child;
+		if (!merge_heap_before(midi, heap[child], tracknum)) break;
+
+		heap[ndx] = heap[child];
+		ndx = child;
+	}
+	heap[ndx] = tracknum;
+}
+
+// add a track that has an event coming up
+void merge_heap_push(MIDIFile *midi, int tracknum) {
+
+	int *heap = midi->merge_heap;
+	int ndx = midi->merge_heap_len++;
+
+	midi->track[tracknum].merge_seq = midi->merge_seq++;
+	while (ndx > 0) {
+		int parent = (ndx - 1) / 2;
+		if (!merge_heap_before(midi, tracknum, heap[parent])) break;
+
+		heap[ndx] = heap[parent];
+		ndx = parent;
+	}
+	heap[ndx] = tracknum;
+}
+
+// the track at the top of the heap has moved on to its next event: put it back in its place
+void merge_heap_advance(MIDIFile *midi) {
+
+	int tracknum = midi->merge_heap[0];
+
+	if (midi->track[tracknum].cmd == CMD_TRACKDONE) { // replace it with the last one
+		if (--midi->merge_heap_len == 0) return;
+		midi->merge_heap[0] = midi->merge_heap[midi->merge_heap_len];
+	}
+	else midi->track[tracknum].merge_seq = midi->merge_seq++; // behind the others at the same time
+
+	merge_heap_sift_down(midi, 0);
+}
+
+
+// put the unfinished tracks in the merge heap
+void merge_start(MIDIFile *midi) {
+
+	midi->merge_heap_len = 0;
+	midi->merge_seq = 0;
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
+		if (midi->track[tracknum].cmd != CMD_TRACKDONE)
+			merge_heap_push(midi, tracknum);
+	}
+}
+
+// make the time of the earliest track's event the global time; False if it is past the window
+int merge_time(MIDIFile *midi) {
+
+	TrackStatus *trk = &midi->track[midi->merge_heap[0]];  /* the track with the earliest event */
+	uint64_t earliest_time = trk->time; // in ticks, of course
+	assert(earliest_time >= midi->timenow_ticks); // "time went backwards in process_track_data"
+
+	midi->timenow_ticks = earliest_time; // we make it the global time
+	midi->timenow_usec = midi_tempo_map_usec(&midi->tempo_map, midi->timenow_ticks);
+	return !(midi->options.end_usec && midi->timenow_usec >= midi->options.end_usec);
+}
+
+// process the earliest track's event, which is at the global time, and move the track on to its next
+int merge_event(MIDIFile *midi) {
+
+	/*
+	    Find the track with the earliest event time, and process it's event.
+
+	    A potential improvement: If there are multiple tracks with the same time,
+	    first do the ones with STOPNOTE as the next command, if any.  That would
+	    help avoid running out of tone generators.  In practice, though, most MIDI
+	    files do all the STOPNOTEs first anyway, so it won't have much effect.
+
+	    The merge heap serves tracks with events at the same time round-robin,
+	    so that if we run out of tone generators, we have been fair to all the tracks.
+	*/
+
+	int tracknum = midi->merge_heap[0];
+	TrackStatus *trk = &midi->track[tracknum];
+
+	MIDI_TRACE(midi, TRACE_MERGE, trk->cmd, tracknum, trk->chan, trk->note, midi->timenow_ticks, midi->timenow_usec);
+
+	ChannelStatus *cp = &midi->channel[trk->chan];  // the channel info, if play or stop
+
+
+	if (trk->cmd == CMD_TEMPO) { // change the global tempo, which affects future usec computations
+
+		if (midi->tempo != trk->tempo) {
+			midi->tempo = trk->tempo;
+			++midi->tempo_changes;
+			if (!midi->tempo_map.complete && !midi_tempo_map_add(&midi->tempo_map, midi->timenow_ticks, trk->tempo))
+				return midi_fail(midi, "out of memory");
+		}
+
+		MIDI_TRACE(midi, TRACE_MERGE_TEMPO, 0, tracknum, 0, 0, midi->tempo, midi->timenow_usec);
+
+		if (!midi_track_next(midi, tracknum)) return False;
+	}
+	else if (trk->cmd == CMD_STOPNOTE) {
+
+		// find the noteinfo for this note -- which better be playing -- in the channel status
+		int ndx = channel_note_find(cp, tracknum, trk->note);
+		if (ndx < 0) { // not found... a stop without a start in the file
+
+			MIDI_TRACE(midi, TRACE_NOTE_NOT_FOUND, 0, tracknum, trk->chan, trk->note, 0, midi->timenow_usec);
+			++midi->notes_unmatched;
+		}
+		else { // we found the channel that was paying this note...
+
+			// Analyze the sustain and release parameters. We might generate another "note on"
+			// command with reduced volume, and/or move the stopnote command earlier than now.
+			NoteInfo *np = &cp->notes_playing[ndx];
+			unsigned long duration_usec = midi->timenow_usec - np->time_usec; // it has the start time in it
+			unsigned long truncation;
+			unsigned long notemin_usec = midi->options.notemin_usec;
+			unsigned long releasetime_usec = midi->options.releasetime_usec;
+			if (duration_usec <= notemin_usec) truncation = 0;
+			else if (duration_usec < releasetime_usec + notemin_usec) truncation = duration_usec - notemin_usec;
+			else truncation = releasetime_usec;
+
+			// NOT SURE WHAT IS GOING ON HERE! BUT IT SEEMS TO WORK
+			np->time_usec = midi->timenow_usec - truncation; // adjust time to be when the note stops
+			if (!queue_cmd(midi, CMD_STOPNOTE, np)) return False;
+			channel_note_stop(cp, ndx);
+			++midi->notes_stopped;
+		}
+		if (!midi_track_next(midi, tracknum)) return False;
+	}
+	else if (trk->cmd == CMD_PLAYNOTE) { // Process only one "start note", so other tracks get a chance at tone generators
+
+		NoteInfo *pn = channel_note_start(midi, cp, tracknum, trk->note); // a slot for it
+		if (!pn) return False;
+		pn->time_usec = midi->timenow_usec; // fill it in
+		pn->channel = trk->chan;
+		pn->instrument = cp->instrument;
+		pn->volume = trk->volume;
+		if (!queue_cmd(midi, CMD_PLAYNOTE, pn)) return False;
+		++midi->notes_started;
+		if (!midi_track_next(midi, tracknum)) return False;
+	}
+	else if (trk->cmd == CMD_PED0) { // PEDAL 0 -- ADDED BY FELIX
+		midi->pedalStatus[0] = trk->pedalVals[0];
+		midi->pedalNote.volume = midi->pedalStatus[0];
+		midi->pedalNote.time_usec = midi->timenow_usec;
+		if (!queue_cmd(midi, CMD_PED0, &midi->pedalNote)) return False;
+		++midi->pedal_changes;
+		if (!midi_track_next(midi, tracknum)) return False;
+	}
+	else if (trk->cmd == CMD_PED1) { // PEDAL 0 -- ADDED BY FELIX
+		midi->pedalStatus[1] = trk->pedalVals[1];
+		midi->pedalNote.volume = midi->pedalStatus[1];
+		midi->pedalNote.time_usec = midi->timenow_usec;
+		if (!queue_cmd(midi, CMD_PED1, &midi->pedalNote)) return False;
+		++midi->pedal_changes;
+		if (!midi_track_next(midi, tracknum)) return False;
+	}
+	else if (trk->cmd == CMD_PED2) { // PEDAL 0 -- ADDED BY FELIX
+		midi->pedalStatus[2] = trk->pedalVals[2];
+		midi->pedalNote.volume = midi->pedalStatus[2];
+		midi->pedalNote.time_usec = midi->timenow_usec;
+		if (!queue_cmd(midi, CMD_PED2, &midi->pedalNote)) return False;
+		++midi->pedal_changes;
+		if (!midi_track_next(midi, tracknum)) return False;
+	}
+	else {
+		printf("BAD CMD in process_track_data"); assert(False);
+	}
+
+	merge_heap_advance(midi);
+	return True;
+}
+
+// once the merge is over: if it stopped at the end of the window, stop the notes still sounding there
+int merge_end(MIDIFile *midi) {
+
+	if (midi->options.end_usec && midi->timenow_usec >= midi->options.end_usec)
+		return midi_seek_end(midi);
+	return True;
+}
+
+int midi_process_track_data(MIDIFile *midi) {
+
+	MIDI_STAGE(midi, STAGE_MERGE);
+	merge_start(midi);
+
+	if (midi->time_stages) midi_stage_loop_start(midi);
+	while (midi->merge_heap_len > 0) { // while there are still track notes to process
+
+		if (midi->time_stages && --midi->stage_countdown <= 0) midi_stage_loop_sample(midi);
+
+		if (!merge_time(midi))
+			break; // the rest is past the window
+		if (!queue_pull_ready(midi) || !merge_event(midi)) return False;
+	}
+	if (midi->time_stages) midi_stage_loop_end(midi, STAGE_OUTPUT);
+
+	// empty the output queue and generate the end-of-score command
+	if (!merge_end(midi) || !flush_queue(midi)) return False;
+
+
+	assert(midi->timenow_usec >= midi->output_usec); // "time deficit at end of song"
+	// with the usec left over from the delays so far, so the delays add up to the end time
+	uint64_t final_msec = (midi->timenow_usec - midi->output_usec + midi->output_deficit_usec) / 1000;
+	MIDI_TRACE(midi, TRACE_END, 0, 0, 0, 0, final_msec, midi->timenow_usec);
+	if (!generate_delay(midi, final_msec)) return False;
+
+	return midi_writeoutput(midi, CMD_STOP);
+}
+
+
+
+int convert_start(MIDIFile *midi) {
+
+	bool seek = midi->options.start_usec > 0;
+
+	if (midi->options.decode_threads > 0 && !midi->index) {
+		// the index is only a quicker way to the same events, so if it can't be built, say for
+		// lack of memory, parse them instead, which finds the same fault if the file has one
+		if (!midi_build_index_threads(midi, midi->options.decode_threads)) midi->error = NULL;
+	}
+	if (seek && !midi->tempo_map.complete) {
+		if (!midi_build_tempo_map(midi)) return False; // which has the index to seek with
+	}
+
+	MIDI_STAGE(midi, STAGE_HEADERS);
+	if (!midi_process_file_header(midi)) return False;
+
+	// initialize for processing of all the tracks
+	midi->tempo = DEFAULT_TEMPO;
+	midi->tracks_done = 0;
+	channel_reset(midi); // in case this file was converted before
+	memset(midi->pedalStatus, 0, sizeof(midi->pedalStatus));
+
+	for (int tracknum = 0; tracknum < midi->num_tracks; ++tracknum) {
+
+		midi->track[tracknum].tempo = DEFAULT_TEMPO;
+		if (!midi_process_track_header(midi, tracknum)) return False;
+		if (seek) continue; // midi_seek positions it
+
+		if (midi->index) midi->track[tracknum].event = midi->index->track_start[tracknum];
+
+		if (!midi_track_next(midi, tracknum)) return False;     /* position to the first note on/off */
+	}
+
+	midi->queue_numitems = 0;
+	midi->num_events = 0;
+	midi->queue_seq = 0;
+	midi->queue_highwater = 0;
+	midi->shadow_numitems = 0;
+	midi->shadow_horizon = 0;
+	midi->events_delayed = 0;
+	midi->events_would_delay = 0;
+	midi->debugcount = 0;
+
+	midi->last_output_was_delay = false;
+	midi->delays_merged = 0;
+	midi->delays_output = 0;
+	midi->consecutive_delays = 0;
+	midi->commands_output = 0;
+	midi->notes_started = midi->notes_stopped = 0;
+	midi->pedal_changes = midi->tempo_changes = 0;
+	tonegen_reset(midi);
+
+	midi->timenow_ticks = 0;
+	midi->timenow_usec = 0;
+	if (!midi->tempo_map.complete && !midi_tempo_map_init(&midi->tempo_map, midi->ticks_per_beat))
+		return midi_fail(midi, "out of memory");
+	midi->output_usec = 0;
+	midi->output_deficit_usec = 0;
+	if (seek)
+		return midi_seek(midi);	// jump to the start of the window
+	return True;
+}
+
+/// Convert a loaded file into midi->output. If midi->output is already set, it is used as the initial output space.
+/// It can be called again on the same file, say with other options, and then overwrites the output.
+/// Only the window of options.start_usec to end_usec is converted.
+/// Returns False, with the reason in midi->error, if the file is broken or there's no memory for the output.
+int midi_convert(MIDIFile *midi) {
+
+	midi->error = NULL;
+	midi->stage_timing = false;
+	midi->iterating = false;
+	if (midi->time_stages) midi_stage_start(midi, STAGE_MERGE); // building the index is parsing
+
+	if (!convert_start(midi)) return False;
+
+	// A note takes fewer bytes in the output than in the tracks (3+2 for play and stop, against
+	// up to 4+4 for on and off), so sizing the output for all the track data avoids growing it.
+	midi->output_len = 0;
+	midi->output_reallocs = 0;
+	midi->output_flushed = 0;
+	midi->sink_error = false;
+	if (midi->sink.write && !midi_output_reserve(midi, midi->sink.chunk_size))
+		return False;
+	if (!midi->sink.write && !midi->output_borrowed && !midi_output_reserve(midi, midi->tracks_len + 16))
+		return False;
+	if (midi->options.output_format == MIDI_FORMAT_COMPACT && !generate_output_header(midi))
+		return False;
+
+	if (!midi_process_track_data(midi))    // do all the tracks interleaved, like a 1950's multiway merge
+		return False;
+
+	midi_output_flush(midi);
+	MIDI_STAGE(midi, STAGE_NONE);
+	return True;
+}
+
+
+/************** event iterator ******************
+
+Instead of converting the whole file, midi_open and midi_next_event hand out the commands that
+would go into the bytestream one at a time, as MIDIEvents with their times and tone generators.
+The merge runs only as far as it must to be sure no command still to come goes before the next
+one -- the release time past it -- and each track is only parsed up to the event the merge is
+at, so a player wanting the next few hundred msec of a score doesn't pay for parsing the rest.
+The events are the same, in the same order, as midi_convert's with collect_events set; there is
+no output. Options, windows included, are as for midi_convert.
+*/
+
+/// Start handing out the events of a loaded file; returns False, with the reason in midi->error, if it is broken
+int midi_open(MIDIFile *midi) {
+
+	midi->error = NULL;
+	midi->stage_timing = false;
+	midi->iterating = true;
+	midi->merge_pending = false;
+	midi->merge_done = false;
+
+	if (!convert_start(midi)) {
+		midi->iterating = false;
+		return False;
+	}
+	merge_start(midi);
+	return True;
+}
+
+/// Get the next event. Returns False at the end, or if the rest of the file is broken, with the reason in midi->error.
+int midi_next_event(MIDIFile *midi, MIDIEvent *event) {
+
+	while (midi->iterating) {
+
+		// first anything queued that nothing still to come can precede, or everything once the merge is over
+		if (midi->queue_numitems > 0 && (midi->merge_done
+		    || midi->queue[0].note.time_usec + midi->options.releasetime_usec < midi->timenow_usec)) {
+
+			QEntry q;
+			queue_pop(midi, &q);
+			midi->output_usec = q.note.time_usec;
+			MIDI_TRACE(midi, TRACE_OUTPUT, q.cmd, q.note.track, q.note.channel, q.note.note, q.note.volume, q.note.time_usec);
+
+			int tgnum = queue_entry_tonegen(midi, &q);
+			if (tgnum < 0) continue; // skipped
+			++midi->commands_output;
+			queue_entry_event(&q, tgnum, event);
+			return True;
+		}
+
+		if (midi->merge_done) // and the queue is empty
+			break;
+		if (midi->merge_pending) { // what goes before the event at the global time is out: now the event
+			midi->merge_pending = false;
+			if (!merge_event(midi)) break;
+		}
+		else if (midi->merge_heap_len > 0 && merge_time(midi))
+			midi->merge_pending = true;
+		else {
+			if (!merge_end(midi)) break;
+			midi->merge_done = true;
+		}
+	}
+
+	midi->iterating = false;
+	return False;
+}
+
+/// Stop handing out events. The file stays loaded, to be opened again, converted, or freed with midi_free.
+void midi_close(MIDIFile *midi) {
+
+	midi->iterating = false;
+	midi->merge_pending = false;
+	midi->merge_done = false;
+	midi->queue_numitems = 0;
+}
+
+
+
+
+/// What the last midi_convert did; the stage times are there if midi->time_stages was set
+void midi_get_stats(const MIDIFile *midi, MIDIStats *stats) {
+
+	memset(stats, 0, sizeof(MIDIStats));
+
+	stats->notes_started = midi->notes_started;
+	stats->notes_stopped = midi->notes_stopped;
+	stats->pedal_changes = midi->pedal_changes;
+	stats->tempo_changes = midi->tempo_changes;
+	if (midi->timenow_usec > midi->options.start_usec)
+		stats->length_usec = midi->timenow_usec - midi->options.start_usec;
+
+	stats->queue_highwater = midi->queue_highwater;
+	stats->events_delayed = midi->events_delayed;
+	stats->events_would_delay = midi->events_would_delay;
+
+	stats->notes_unmatched = midi->notes_unmatched;
+	stats->notes_skipped = midi->notes_skipped;
+	stats->notes_over_slots = midi->notes_over_slots;
+	stats->notes_playing_max = midi->notes_playing_max;
+	stats->tonegens_used = midi->tonegens_used;
+	stats->instrument_changes = midi->instrument_changes;
+
+	stats->commands_output = midi->commands_output;
+	stats->delays_output = midi->delays_output;
+	stats->delays_merged = midi->delays_merged;
+	stats->consecutive_delays = midi->consecutive_delays;
+	stats->output_bytes = midi->output_flushed + midi->output_len;
+
+	if (midi->time_stages) {
+		for (int stage = 0; stage < NUM_STAGES; ++stage) {
+			stats->stage_nsec[stage] = midi->stage_nsec[stage];
+			stats->total_nsec += midi->stage_nsec[stage];
+		}
+	}
+}
+
+
+int midi_binarize( const char* midifile, const char* outfile) {
+
+	return midi_binarize_opt(midifile, outfile, NULL);
+}
+
+/// midi_binarize with conversion options; NULL options means the defaults
+int midi_binarize_opt(const char* midifile, const char* outfile, const MIDIOptions *options) {
+
+	return midi_binarize_stats(midifile, outfile, options, NULL);
+}
+
+/// midi_binarize_opt that fills in stats, with the stages timed, unless it is NULL
+int midi_binarize_stats(const char* midifile, const char* outfile, const MIDIOptions *options, MIDIStats *stats) {
+
+	if (stats) memset(stats, 0, sizeof(MIDIStats));
+
+	FILE *fout = NULL;
+	if (outfile) {
+		fout = fopen(outfile, "wb");
+		if (!fout) return -1;
+	}
+
+	MIDIFile *midi = midi_load(midifile, MIDI_LOAD_MMAP);
+	if (!midi) {
+		if (fout) fclose(fout);
+		return -1;
+	}
+
+	if (options) midi->options = *options;
+	if (fout) midi_set_sink(midi, midi_write_file, fout, 0);
+	midi->time_stages = stats != NULL;
+
+	int result = midi_convert(midi) && !midi->sink_error ? 0 : -1;
+	if (fout && fclose(fout) != 0) result = -1;
+	if (stats) midi_get_stats(midi, stats);
+
+	midi_free(midi);
+	return result;
+}
+
+/// Convert a MIDI file, streaming the bytestream to an open file descriptor as it is generated
+int midi_binarize_fd(const char* midifile, int fd, const MIDIOptions *options) {
+
+	MIDIFile *midi = midi_load(midifile, MIDI_LOAD_MMAP);
+	if (!midi) return -1;
+
+	if (options) midi->options = *options;
+	midi_set_sink(midi, midi_write_fd, (void*)(intptr_t)fd, 0);
+
+	int result = midi_convert(midi) && !midi->sink_error ? 0 : -1;
+	midi_free(midi);
+	return result;
+}
+
+/*
+	Convert a MIDI file that is already in memory, without touching the filesystem.
+
+	If *output is not NULL, the bytestream is written into that caller-owned space of output_mem
+	bytes, of which up to 4 GB are used. Should it not fit, the bytestream is moved to a malloc'd
+	buffer instead.
+	On return *output points to the bytestream and *output_len is its length; the caller must
+	free() *output if it is not the space it passed in.
+*/
+int midi_binarize_buffer(const void *mididata, size_t midilen, byte **output, size_t *output_len, size_t output_mem,
+                         const MIDIOptions *options) {
+
+	MIDIFile *midi = midi_load_buffer(mididata, midilen);
+	if (!midi) return -1;
+
+	if (options) midi->options = *options;
+	if (*output && output_mem > 0) {
+		midi->output = *output;
+		midi->output_mem = output_mem < UINT32_MAX ? output_mem : UINT32_MAX;
+		midi->output_borrowed = true;
+	}
+
+	if (!midi_convert(midi)) {
+		*output_len = 0; // *output is left as it was
+		midi_free(midi);
+		return -1;
+	}
 
+	*output = midi->output;
+	*output_len = midi->output_len;
+	midi->output = NULL; // it belongs to the caller now
 
 	midi_free(midi);
 	return 0;
@@ -2,6 +2,10 @@
 #ifndef MIDILIB
 #define MIDILIB
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define VERSION "1.0"
 #define True 1
@@ -10,17 +14,29 @@
 #define DEFAULT_TEMPO 500000L   // the MIDI-specified default tempo in usec/beat 
 #define DEFAULT_BEATTIME 240    // the MIDI-specified default ticks per beat 
 
-#define MAX_TRACKS 24           // max number of MIDI tracks we will process
+#define MAX_TRACKS 128          // max number of MIDI tracks we will process
 #define PERCUSSION_TRACK 9      // the track MIDI uses for percussion sounds
 
 #define NUM_CHANNELS 16         // MIDI-specified number of channels
-#define MAX_CHANNELNOTES 24     // max number of notes playing simultaneously on a channel
+#define MAX_CHANNELNOTES 24     // notes playing on a channel that the old fixed slots had room for
+#define MAX_TONEGENS 16         // max tone generators, since the generator # is the low nibble of a command
+#define NUM_INSTRUMENTS 128     // MIDI-specified number of instruments (programs)
 
-#define notemin_usec 250   		// minimum note time in usec after the release is deducted
-#define releasetime_usec 0 		// release time in usec for silence at the end of notes
+#define DEFAULT_NOTEMIN_USEC 250   	// minimum note time in usec after the release is deducted
+#define DEFAULT_RELEASETIME_USEC 0 	// release time in usec for silence at the end of notes
 
 
-#define QUEUE_SIZE 100 			// maximum number of note play/stop commands we queue
+#define QUEUE_SIZE 100 			// initial queue space; also the size of the old fixed queue, for events_would_delay
+
+
+#define DESCRIBE_LEN 100 		// space needed for describe() to describe a note
+
+#define MIDI_SINK_CHUNK 4096 	// default number of bytes an output sink is given at a time
+
+
+// how midi_load brings the file into memory
+#define MIDI_LOAD_READ 	0 		// read it into an allocated buffer
+#define MIDI_LOAD_MMAP 	1 		// map it read-only; falls back to reading for pipes etc.
 
 
 // output bytestream commands, which are also stored in track_status.cmd *******
@@ -33,6 +49,16 @@
 #define CMD_PED1        0xb0    /* control 66 -- sostenuto pedal */
 #define CMD_PED2        0xd0    /* control 67 -- soft pedal*/
 
+/* delays are the bytes without the top bit; how they are encoded depends on the output format */
+#define DELAY_CLASSIC_MAX 0x7fff  /* classic: two bytes, big-endian msec */
+#define DELAY_SHORT     0x40    /* compact: DELAY_SHORT | msec is one byte, for up to DELAY_SHORT_MAX msec */
+#define DELAY_SHORT_MAX 0x3f
+#define DELAY_COMPACT_MAX 0x3fff  /* compact: otherwise two bytes, big-endian msec, under DELAY_SHORT */
+
+/// options.output_format
+#define MIDI_FORMAT_CLASSIC 0   // no header, and every delay takes two bytes
+#define MIDI_FORMAT_COMPACT 1   // a MIDIOutputHeader first, and one-byte delays where they fit
+
 /* the following other commands are stored in the track_status.com */
 #define CMD_TEMPO       0xFE    /* tempo in usec per quarter note ("beat") */
 #define CMD_TRACKDONE   0xFF    /* no more data left in this track */
@@ -64,6 +90,22 @@ struct track_header {
 	uint32_t track_size;
 };
 
+/// what the compact format starts with: org.c's optional file header, with the format added
+typedef struct midi_output_header MIDIOutputHeader;
+struct midi_output_header {
+
+	char 		id1;			// 'P'
+	char 		id2;			// 't'
+	byte 		hdr_length;		// length of the whole header, so players can skip what they don't know
+	byte 		f1;				// flag byte 1
+	byte 		f2;				// flag byte 2
+	byte 		num_tgens;		// how many tone generators the score uses
+	byte 		format;			// MIDI_FORMAT_xxx
+};
+#define HDR_F1_VOLUME_PRESENT 0x80
+#define HDR_F1_INSTRUMENTS_PRESENT 0x40
+#define HDR_F1_PERCUSSION_PRESENT 0x20
+
 /* ***************************************************** */
 
 
@@ -80,6 +122,8 @@ struct track_status {
 	byte chan, note, volume;     // if it is CMD_PLAYNOTE or CMD_STOPNOTE, the note info
 	byte last_event;             // the last event, for MIDI's "running status"
 	byte pedalVals[3];           // ADDED BY FELIX for PEDALS
+	unsigned long merge_seq;     // tie-breaker in the merge heap: lower was (re)queued earlier
+	int event;                   // the next event in midi->index, if the tracks are converted from one
 };
 
 
@@ -95,9 +139,22 @@ struct noteinfo {
 typedef struct channel_status ChannelStatus;
 struct channel_status {          
 
-	int 		instrument;               			// which instrument this channel currently plays
-	bool 		note_playing[MAX_CHANNELNOTES]; 	// slots for notes that are playing on this channel
-	NoteInfo 	notes_playing[MAX_CHANNELNOTES]; 	// information about them
+	int 		instrument;               	// which instrument this channel currently plays
+	NoteInfo 	*notes_playing; 			// slots for the notes that are playing on this channel
+	uint64_t 	*slot_busy;					// a bit for each slot that is in use
+	int 		*slot_next;					// the next slot playing the same note number, plus one; 0 if none
+	int 		num_slots;					// how many slots there is space for, a multiple of 64
+	int 		note_first[128];			// for each note number, the first slot playing it, plus one
+	int 		num_playing;
+};
+
+
+/// current status of a tone generator, if notes are assigned to them
+typedef struct tonegen_status ToneGen;
+struct tonegen_status {
+
+	int 		instrument;				// what it was last set to play
+	int 		channel, note;			// what it is playing, if it is
 };
 
 
@@ -106,20 +163,255 @@ struct queue_entry {      // the format of each queue entry
 	
 	byte cmd;              // CMD_PLAY or CMD_STOP
 	struct noteinfo note;  // info about the note, including the action time
+	uint64_t seq;          // order in which it was queued, to keep same-time entries stable
 };
 
 
 
+/// a command as it comes out of the output queue, in time order; collected if midi->collect_events is set
+typedef struct midi_event MIDIEvent;
+struct midi_event {      // laid out for use as a NumPy structured array (see midilib.py)
+
+	uint64_t 	time_usec;		// when it happens, in usec since the start of the score
+	int32_t 	track;
+	int32_t 	channel;
+	int32_t 	note;
+	int32_t 	instrument;
+	int32_t 	volume;			// or the pedal value
+	byte 		cmd;			// CMD_PLAYNOTE, CMD_STOPNOTE or CMD_PEDx
+	byte 		tonegen;		// the tone generator it was assigned to; 0 if they aren't
+	byte 		unused[2];
+};
+
+
+
+/***********  tracing  *****************
+
+In builds with DEBUG defined, the conversion reports what it does to a trace hook, if one is set
+with midi_set_trace. Without DEBUG the trace points are compiled out and cost nothing.
+*/
+
+// trace event kinds; time is in ticks for the TRACE_PARSE_ kinds and in usec for the others
+#define TRACE_FILE_HEADER 		0x01 	/* value: number of tracks, note: format type, time: ticks per beat */
+#define TRACE_TRACK_HEADER 		0x02 	/* value: track length */
+#define TRACE_PARSE_NOTE_OFF 	0x10 	/* chan, note, value: volume */
+#define TRACE_PARSE_NOTE_ON 	0x11 	/* chan, note, value: volume */
+#define TRACE_PARSE_META 		0x12 	/* note: meta command, value: length */
+#define TRACE_PARSE_TEMPO 		0x13 	/* value: usec per beat */
+#define TRACE_PARSE_KEY_PRESSURE 0x14 	/* chan, note, value: pressure */
+#define TRACE_PARSE_CONTROL 	0x15 	/* chan, note: controller, value */
+#define TRACE_PARSE_PROGRAM 	0x16 	/* chan, value: instrument */
+#define TRACE_PARSE_PRESSURE 	0x17 	/* chan, value: after-touch pressure */
+#define TRACE_PARSE_PITCHBEND 	0x18 	/* chan, value: pitch wheel */
+#define TRACE_PARSE_SYSEX 		0x19 	/* note: event, value: length */
+#define TRACE_MERGE 			0x20 	/* track, value: time in ticks */
+#define TRACE_MERGE_TEMPO 		0x21 	/* value: usec per beat */
+#define TRACE_NOTE_NOT_FOUND 	0x23 	/* track, chan, note: stopped, but not playing */
+#define TRACE_QUEUE 			0x30 	/* cmd, track, chan, note, value: volume */
+#define TRACE_QUEUE_DELAYED 	0x31 	/* value: usec the event was delayed */
+#define TRACE_PULL 				0x40 	/* value: the deficit after the pull, in usec */
+#define TRACE_OUTPUT 			0x41 	/* cmd, note, value: volume */
+#define TRACE_DELAY 			0x42 	/* value: msec */
+#define TRACE_CONSECUTIVE_DELAY 0x43 	/* value: msec of a delay right after another one */
+#define TRACE_NO_TONEGEN 		0x44 	/* track, chan, note: every tone generator is busy, so it is skipped */
+#define TRACE_END 				0x4f 	/* value: the final delay in msec */
+
+typedef struct midi_trace MIDITrace;
+struct midi_trace {
+
+	uint64_t 	time;
+	uint32_t 	value;
+	byte 		kind;		// TRACE_xxx
+	byte 		cmd;
+	byte 		track;
+	byte 		chan;
+	byte 		note;
+};
+
+typedef void (*MIDITraceFn)(void *arg, const MIDITrace *trace);
+
+/// keeps the latest trace events in memory, for looking at after a conversion
+typedef struct midi_trace_ring MIDITraceRing;
+struct midi_trace_ring {
+
+	MIDITrace 	*entries;
+	uint32_t 	size;		// a power of two
+	uint64_t 	count;		// how many events were ever traced; the latest size of them are kept
+};
+
+
+/***********  stage timing  *****************
+
+With time_stages set, midi_convert adds up the time it spends in each stage in stage_nsec, to
+find where a slowdown comes from. The clock is read whenever the work moves on to another
+stage, which would be a few times for each event, so in the merge loop only about one event
+in STAGE_SAMPLE is timed, and the loop's time is split up between the stages in the proportions
+of the sampled ones. That makes it cheap enough to leave on. The gaps between the samples are
+random, so that they don't fall into step with a score that repeats itself.
+*/
+
+#define STAGE_SAMPLE 	64
+
+#define STAGE_HEADERS 	0	// the file and track headers, up to each track's first event
+#define STAGE_MERGE 	1	// parsing the tracks and merging their events in time order
+#define STAGE_QUEUE 	2	// holding the commands in the output queue until they are due
+#define STAGE_OUTPUT 	3	// tone generators, delays and command bytes, and the sink
+#define NUM_STAGES 		4
+#define STAGE_NONE 		NUM_STAGES	// not converting
+
+/// what a conversion did, from midi_get_stats or midi_binarize_stats
+typedef struct midi_stats MIDIStats;
+struct midi_stats {
+
+	uint32_t 	notes_started;			// the events merged, by kind
+	uint32_t 	notes_stopped;
+	uint32_t 	pedal_changes;
+	uint32_t 	tempo_changes;
+	uint64_t 	length_usec;			// of the score, or of the window converted
+
+	uint32_t 	queue_highwater;		// the most commands queued at once
+	uint32_t 	events_delayed;			// commands output late; should be 0
+	uint32_t 	events_would_delay;		// pulled early by a full queue, if it were the old fixed one
+
+	uint32_t 	notes_unmatched;		// stops of notes that weren't playing, which are dropped
+	uint32_t 	notes_skipped;			// notes dropped for want of a tone generator
+	uint32_t 	notes_over_slots;		// notes the old fixed slots would have dropped
+	uint32_t 	notes_playing_max;		// the most notes playing at once on a channel
+	uint32_t 	tonegens_used;
+	uint32_t 	instrument_changes;
+
+	uint32_t 	commands_output;		// note, instrument and pedal commands
+	uint32_t 	delays_output;
+	uint32_t 	delays_merged;			// into the one before, in the compact format
+	uint32_t 	consecutive_delays;		// right after another, in the classic format
+	uint64_t 	output_bytes;
+
+	uint64_t 	stage_nsec[NUM_STAGES];	// with time_stages set, or from midi_binarize_stats
+	uint64_t 	total_nsec;
+};
+
+
+/***********  arena  *****************
+
+The space a conversion keeps until the MIDIFile is reset is carved from an arena, which is
+given back all at once; see arena.c. Each MIDIFile has its own, or uses one set by midi_set_arena.
+*/
+
+#define MIDI_ARENA_BLOCK 65536 		// the least an arena allocates at a time, by default
+
+typedef struct midi_arena_block MIDIArenaBlock;
+struct midi_arena_block {
+
+	MIDIArenaBlock 	*prev;			// the block before, which is full
+	size_t 			size;			// of the space after the header
+	size_t 			used;
+};
+
+typedef struct midi_arena MIDIArena;
+struct midi_arena {
+
+	MIDIArenaBlock 	*block;			// the one being carved up, or NULL before the first piece
+	void 			*last;			// the latest piece, which can grow where it is
+	size_t 			block_size;		// the least to allocate for a block; 0 for MIDI_ARENA_BLOCK
+	size_t 			total;			// space in all the blocks
+	size_t 			used;			// taken since the last reset
+	size_t 			highwater;		// the most ever taken between resets
+	uint32_t 		resets;
+};
+
+
+/***********  event index  *****************
+
+midi_build_index decodes every track once into columns of the events the conversion uses, so
+that converting the same file again, with different options, doesn't parse the tracks again.
+The index keeps the events of all channels; which ones are wanted is decided when converting.
+*/
+
+typedef struct midi_event_index MIDIEventIndex;
+struct midi_event_index {
+
+	uint64_t 	*time;			// when, in ticks since the start of the track, which can pass 32 bits
+	byte 		*cmd;			// CMD_PLAYNOTE, CMD_STOPNOTE, CMD_TEMPO, CMD_PEDx or CMD_INSTRUMENT
+	byte 		*chan;
+	byte 		*note;
+	uint32_t 	*value;			// volume, pedal value, tempo in usec/beat, or instrument
+	int 		num_events;
+	int 		mem;			// how many events there is space for in each column
+	MIDIArena 	*arena;			// where the columns come from, or NULL for malloc
+	int 		track_start[MAX_TRACKS + 1];	// track n's events are from track_start[n] up to track_start[n+1]
+};
+
+
+/***********  tempo map  *****************/
+
+typedef struct midi_tempo_change MIDITempoChange;
+struct midi_tempo_change {
+
+	uint64_t 	tick;			// where the tempo changes
+	uint64_t 	usec;			// the time it changes, in usec since the start of the score
+	uint32_t 	tempo;			// the new tempo, in usec/beat
+};
+
+/// the tempo changes in tick order, to convert between ticks and usec anywhere in the score
+typedef struct midi_tempo_map MIDITempoMap;
+struct midi_tempo_map {
+
+	MIDITempoChange *changes;	// the first is the default tempo at tick 0
+	int 		len;
+	int 		mem;
+	uint32_t 	ticks_per_beat;
+	bool 		complete;		// made by midi_build_tempo_map, so the merge doesn't add to it
+	MIDIArena 	*arena;			// where changes comes from, or NULL for malloc
+};
+
+
+/// how to convert, which can be different for every conversion
+typedef struct midi_options MIDIOptions;
+struct midi_options {
+
+	unsigned 		channel_mask;		// bit mask of channels to process
+	bool 			percussion_ignore;	// drop the notes on the PERCUSSION_TRACK channel
+	unsigned long 	notemin_usec;		// minimum note time in usec after the release is deducted
+	unsigned long 	releasetime_usec;	// release time in usec for silence at the end of notes
+	uint64_t 		start_usec;			// convert from here on, starting with the notes sounding then
+	uint64_t 		end_usec;			// stop here, with the notes still sounding stopped; 0 for the end
+	int 			decode_threads;		// if > 0, decode the tracks into an index on this many threads first
+	int 			num_tonegens;		// if > 0, assign the notes to this many tone generators, up to MAX_TONEGENS;
+										// otherwise every note is output on generator 0
+	bool 			tonegen_per_track;	// try the generator the track used last ("strategy 2" in org.c)
+	int 			output_format;		// MIDI_FORMAT_xxx
+};
+
+
+/// receives the output bytestream a chunk at a time; returns False on failure
+typedef int (*MIDIOutputFn)(void *arg, const byte *data, uint32_t len);
+
+typedef struct midi_sink MIDISink;
+struct midi_sink {
+
+	MIDIOutputFn 	write;			// NULL to keep the whole output in memory
+	void 			*arg;			// passed to write
+	uint32_t 		chunk_size;		// how much output is collected before calling write
+};
+
+
 typedef struct MIDIFile MIDIFile;
 struct MIDIFile {
 
+	MIDIOptions options;			// set after loading; midi_load* fill in the defaults
+
 	byte 		*data;
 	byte		*content; 			// pointer to data after header
 	byte 		*dataptr; 			// used as a runaway pointer in the data
 	long 		data_len;
+	bool 		data_mapped;		// data is an mmap of the file rather than an allocated copy
+	bool 		data_borrowed;		// data belongs to the caller, and is not freed
 
 	MIDIHeader 	*header;
 	uint16_t 	num_tracks;
+	uint32_t 	tracks_len;			// total bytes of track data
+
+	MIDIEventIndex *index;			// if set, the tracks are converted from it instead of parsed
 
 	TrackStatus track[MAX_TRACKS];
 	ChannelStatus channel[NUM_CHANNELS];
@@ -127,32 +419,255 @@ struct MIDIFile {
 	int 		tracks_done;
 	uint64_t 	timenow_ticks;			// the current processing time in ticks
 	uint64_t 	timenow_usec; 			// the current processing time in usec
-	uint64_t 	timenow_usec_updated;   // when, in ticks, we last updated timenow_usec using the current tempo
-	uint32_t 	output_usec;			// the time we last output, in usec
+	timestamp 	output_usec;			// the time we last output, in usec
 	uint32_t 	output_deficit_usec; 	// the leftover usec < 1000 still to be used for a "delay"
 
 
 	uint32_t 	time_division;
 	uint32_t 	ticks_per_beat;
 	uint64_t 	tempo;				// current global tempo in usec/beat
+	MIDITempoMap tempo_map;			// the tempo changes so far, or all of them after midi_build_tempo_map
+
+
+	int 		merge_heap[MAX_TRACKS];	// unfinished tracks, as a min-heap on (time, merge_seq)
+	int 		merge_heap_len;
+	unsigned long merge_seq;			// next sequence number to give a track entering the heap
+
+	int 		pedalStatus[3];		// last value of each pedal
+	NoteInfo 	pedalNote;			// used to queue the pedal commands
 
+	int 		notes_started;		// the events merged, by kind
+	int 		notes_stopped;
+	int 		pedal_changes;
+	int 		tempo_changes;
 
-	QEntry 		queue[QUEUE_SIZE];
+
+	QEntry 		*queue;				// min-heap of queued commands
 	int 		queue_numitems;
-	int 		queue_oldest_ndx;
-	int 		queue_newest_ndx;
+	int 		queue_mem;			// how many entries there is space for
+	uint64_t 	queue_seq;			// next queue entry sequence number
+	int 		queue_highwater;	// the most entries ever queued at once
 	int 		debugcount;
 
+	timestamp 	shadow_queue[QUEUE_SIZE];	// min-heap of the times the old fixed queue would hold
+	int 		shadow_numitems;
+	timestamp 	shadow_horizon;		// where the old queue's output time would be
+	int 		events_delayed;		// events moved later so as not to precede the output; should be 0
+	int 		events_would_delay;	// events the old fixed queue would have had to delay
+	int 		notes_unmatched;	// notes stopped that weren't playing on their track; the stop is dropped
+	int 		notes_playing_max;	// the most notes playing at once on a channel
+	int 		notes_over_slots;	// notes started with MAX_CHANNELNOTES already playing, which used to be dropped
+
 	bool 		last_output_was_delay;
+	uint64_t 	delay_start;		// where in the whole output the last delay starts, if it was the last output
+	uint64_t 	delay_msec;			// and how long it is
+	int 		delays_merged;		// delays added to the one just before, in the compact format
+	int 		delays_output;		// delay commands written
+	int 		consecutive_delays;	// of those, ones right after another delay, in the classic format
+	int 		commands_output;	// note, instrument and pedal commands written
+
+	ToneGen 	tonegen[MAX_TONEGENS];
+	uint16_t 	tonegen_free;						// a bit for each generator that isn't playing
+	uint16_t 	tonegen_instrument[NUM_INSTRUMENTS];	// for each instrument, the generators last set to it
+	uint16_t 	tonegen_playing[NUM_CHANNELS][128];	// for each channel and note, the generators playing it
+	int 		tonegens_used;		// the highest generator number used, plus one
+	int 		notes_skipped;		// notes not played because every generator was busy
+	int 		instrument_changes;	// times a generator was given a different instrument
+	int 		playnotes_without_stopnotes;	// notes started again while still playing
+	int 		stopnotes_without_playnotes;	// notes stopped that weren't playing, mostly skipped ones
 
 	byte 		*output;
 	uint32_t 	output_len;		// how much of the output space is used
 	uint32_t 	output_mem;		// how much space is allocated for the output
+	bool 		output_borrowed;	// output is space given by the caller, and is not freed or realloc'd
+	uint32_t 	output_reallocs;	// how many times the output space had to grow
+
+	MIDITraceFn trace;				// trace hook, only called in DEBUG builds
+	void 		*trace_arg;
+
+	MIDISink 	sink;				// where the output is streamed to, if anywhere
+	uint64_t 	output_flushed;		// how much output has already been given to the sink
+	bool 		sink_error;			// the sink failed, so the rest of the output was dropped
+
+	const char 	*error;				// why midi_convert failed, or NULL
+
+	bool 		collect_events;		// keep every command output in events, too
+	MIDIEvent 	*events;
+	uint32_t 	num_events;
+	uint32_t 	events_mem;			// how many events there is space for
+
+	bool 		iterating;			// between midi_open and the end, events are taken by midi_next_event
+	bool 		merge_pending;		// the global time is at an event the merge hasn't processed yet
+	bool 		merge_done;			// all the tracks are merged, and only the queue is left
+
+	bool 		time_stages;		// add up the time spent in each stage in stage_nsec
+	bool 		stage_timing;		// the clock is read at the stage switches now
+	int 		stage;				// the STAGE_xxx the time is going to
+	uint64_t 	stage_since;		// since when, in nsec
+	uint64_t 	stage_nsec[NUM_STAGES];
+	uint64_t 	stage_loop_since;	// when the merge loop started
+	uint64_t 	stage_outside_nsec[NUM_STAGES];	// the times before the loop, while the samples are in stage_nsec
+	int 		stage_countdown;	// events to merge until the next sample starts or ends
+	uint32_t 	stage_random;		// for the gaps between samples
+
+	MIDIArena 	*arena;				// where the space kept until midi_reset comes from; set by loading
+	MIDIArena 	own_arena;			// which is this unless midi_set_arena gives another
 };
 
 
 
+void midi_default_options(MIDIOptions *options);
+
+int midi_load_into(MIDIFile *midi, const char* midifile, int load_mode);
+MIDIFile* midi_load(const char* midifile, int load_mode);
+MIDIFile* midi_load_buffer(const void *mididata, size_t midilen);
+void midi_free(MIDIFile *midi);
+void midi_reset(MIDIFile *midi);
+int midi_fail(MIDIFile *midi, const char *error);
+int midi_process_file_header(MIDIFile *midi);
+int midi_process_track_header(MIDIFile *midi, int tracknum);
+int midi_want_channel(MIDIFile *midi, int chan);
+int midi_find_next_note(MIDIFile *midi, int tracknum);
+int midi_build_index(MIDIFile *midi);
+int midi_build_index_threads(MIDIFile *midi, int num_threads);
+void midi_free_index(MIDIFile *midi);
+int midi_index_next_note(MIDIFile *midi, int tracknum);
+
+unsigned long get_varlen(uint8_t **ptr, const uint8_t *end);
+unsigned long get_varlen_bytewise(uint8_t **ptr, const uint8_t *end);
+char *describe(NoteInfo *np, char *notedescription);
+
+int midi_write_fd(void *arg, const byte *data, uint32_t len);
+int midi_write_file(void *arg, const byte *data, uint32_t len);
+void midi_set_sink(MIDIFile *midi, MIDIOutputFn write, void *arg, uint32_t chunk_size);
+
+int midi_convert(MIDIFile *midi);
+void midi_get_stats(const MIDIFile *midi, MIDIStats *stats);
+int midi_set_window_ticks(MIDIFile *midi, uint64_t start_tick, uint64_t end_tick);
+
+int midi_open(MIDIFile *midi);
+int midi_next_event(MIDIFile *midi, MIDIEvent *event);
+void midi_close(MIDIFile *midi);
+
 int midi_binarize( const char* midifile, const char* outfile);
+int midi_binarize_opt(const char* midifile, const char* outfile, const MIDIOptions *options);
+int midi_binarize_stats(const char* midifile, const char* outfile, const MIDIOptions *options, MIDIStats *stats);
+int midi_binarize_fd(const char* midifile, int fd, const MIDIOptions *options);
+int midi_binarize_buffer(const void *mididata, size_t midilen, byte **output, size_t *output_len, size_t output_mem,
+                         const MIDIOptions *options);
+
+
+/***********  tracing and stage timing (trace.c)  *****************/
+
+void midi_set_trace(MIDIFile *midi, MIDITraceFn trace, void *arg);
+void midi_trace_emit(MIDIFile *midi, byte kind, byte cmd, int track, byte chan, byte note, uint32_t value, uint64_t time);
+void midi_trace_print(FILE *fid, const MIDITrace *trace);
+void midi_trace_to_file(void *arg, const MIDITrace *trace);
+int midi_trace_ring_init(MIDITraceRing *ring, uint32_t size);
+void midi_trace_ring_free(MIDITraceRing *ring);
+void midi_trace_to_ring(void *arg, const MIDITrace *trace);
+void midi_stage_start(MIDIFile *midi, int stage);
+void midi_stage_switch(MIDIFile *midi, int stage);
+void midi_stage_loop_start(MIDIFile *midi);
+void midi_stage_loop_sample(MIDIFile *midi);
+void midi_stage_loop_end(MIDIFile *midi, int stage);
+
+
+/***********  tempo map (tempo.c)  *****************/
+
+int midi_tempo_map_init(MIDITempoMap *map, uint32_t ticks_per_beat);
+void midi_tempo_map_free(MIDITempoMap *map);
+int midi_tempo_map_add(MIDITempoMap *map, uint64_t tick, uint32_t tempo);
+uint64_t midi_tempo_map_usec(MIDITempoMap *map, uint64_t tick);
+uint64_t midi_tempo_map_ticks(MIDITempoMap *map, uint64_t usec);
+uint32_t midi_tempo_map_tempo(MIDITempoMap *map, uint64_t tick);
+int midi_build_tempo_map(MIDIFile *midi);
+
+
+/***********  arena (arena.c)  *****************/
+
+void midi_arena_init(MIDIArena *arena, size_t block_size);
+void *midi_arena_alloc(MIDIArena *arena, size_t len);
+void midi_arena_reset(MIDIArena *arena);
+void midi_arena_free(MIDIArena *arena);
+void midi_set_arena(MIDIFile *midi, MIDIArena *arena);
+void *midi_arena_grow(MIDIArena *arena, void *ptr, size_t old_len, size_t len);
+void midi_arena_drop(MIDIArena *arena, void *ptr);
+
+
+/***********  reading the bytestream back (decode.c)  *****************/
+
+#define SMF_TICKS_PER_BEAT 1000		// what midi_stream_to_smf writes: a tick is a msec
+#define SMF_TEMPO 1000000
+#define SMF_MAX_DELTA 0x0fffffff	// the longest delta time a variable-length number holds
+
+#define MIDI_FORMAT_DETECT -1		// MIDIStream.expect_format: compact if it starts with a whole, valid header
+
+/// an event of a decoded bytestream
+typedef struct midi_stream_event MIDIStreamEvent;
+struct midi_stream_event {
+
+	uint64_t 	time_msec;		// since the start of the score
+	byte 		cmd;			// CMD_PLAYNOTE, CMD_STOPNOTE, CMD_INSTRUMENT or CMD_PEDx, without the tone generator
+	byte 		tonegen;
+	byte 		note;			// or the instrument
+	byte 		value;			// the volume, or the pedal value
+};
+
+typedef struct midi_stream MIDIStream;
+struct midi_stream {
+
+	MIDIStreamEvent *events;
+	uint32_t 	num_events;
+	uint32_t 	events_mem;		// how many events there is space for
+	uint64_t 	length_msec;	// the time of the CMD_STOP at the end
+	int 		expect_format;	// set before midi_decode_stream: the MIDI_FORMAT_xxx it is in, or MIDI_FORMAT_DETECT
+	int 		format;			// the one it was decoded as
+	int 		num_tgens;		// from the header, or 1
+	const char 	*error;			// why midi_decode_stream failed, or NULL
+};
+
+typedef struct midi_roundtrip MIDIRoundTrip;
+struct midi_roundtrip {
+
+	uint32_t 	matched;		// events in both, within a msec of each other
+	uint32_t 	missing;		// events of the score that aren't in the bytestream
+	uint32_t 	extra;			// events in the bytestream that aren't in the score
+	uint32_t 	max_error_usec;	// the furthest a matched event is from its time in the score
+};
+
+int midi_decode_stream(MIDIStream *stream, const byte *data, size_t len);
+void midi_stream_free(MIDIStream *stream);
+int midi_stream_to_smf(const MIDIStream *stream, byte **smf, size_t *smf_len);
+int midi_check_roundtrip(MIDIFile *midi, const MIDIStream *stream, MIDIRoundTrip *result);
+
+
+/***********  batch conversion (batch.c)  *****************/
+
+typedef struct midi_batch_item MIDIBatchItem;
+struct midi_batch_item {
+
+	const char 	*midifile;			// input path
+	const char 	*outfile;			// output path, or NULL to just convert
+	int 		result;				// as from midi_binarize: 0 if it worked
+	const char 	*error;				// why it didn't, or NULL
+	uint64_t 	bytes_in;
+	uint64_t 	bytes_out;
+	double 		seconds;			// how long the conversion took
+};
+
+typedef struct midi_batch_stats MIDIBatchStats;
+struct midi_batch_stats {
+
+	int 		files;
+	int 		failed;
+	uint64_t 	bytes_in;
+	uint64_t 	bytes_out;
+	double 		seconds;			// wall-clock time for the whole batch
+};
+
+int midi_binarize_batch(MIDIBatchItem *items, int num_items, int num_threads, const MIDIOptions *options,
+                        MIDIBatchStats *stats);
 
 
 
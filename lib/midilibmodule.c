@@ -0,0 +1,452 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <errno.h>
+
+#include "midilib.h"
+
+
+/*
+	The _midilib Python extension: converts MIDI data to the bytestream in the calling process.
+
+	_midilib.convert(data, **options) takes anything with the buffer protocol (bytes, bytearray,
+	memoryview, mmap, ...) and reads it in place; _midilib.convert_file(path, **options) maps the
+	file. Both return the bytestream as bytes. The output is written straight into the bytes
+	object, which is made big enough for the usual case and then shrunk, so it is only copied when
+	a score makes more output than that. The GIL is released while converting, so conversions on
+	several Python threads run at once. A broken file raises _midilib.MIDIError.
+
+	The options are keyword-only, named as in MIDIOptions: channel_mask, percussion_ignore,
+	notemin_usec, releasetime_usec, start_usec, end_usec, decode_threads, num_tonegens,
+	tonegen_per_track and output_format.
+
+	_midilib.events(data, **options) and _midilib.events_file(path, **options) convert the same
+	way, but return the commands that went into the bytestream, in time order, as an Events
+	object: the MIDIEvent array that midi_convert collected, handed over rather than copied, with
+	the buffer protocol on it. midilib.py makes that a NumPy structured array without copying.
+
+	_midilib.convert_stats(data, **options) and _midilib.convert_file_stats(path, **options) return
+	(bytes, stats) instead, where stats is a dict of the MIDIStats of the conversion, with the
+	stages timed. The names are as in MIDIStats, with stage_nsec split up into headers_nsec,
+	merge_nsec, queue_nsec and output_nsec.
+
+	_midilib.convert_many(inputs, outputs=None, *, workers=0, **options) converts a list of files
+	with midi_binarize_batch, on that many threads (0 for one per processor) and with the GIL
+	released for the whole batch. It returns a (ok, error, seconds, bytes_in, bytes_out) tuple for
+	each input, in order; outputs can be None to convert without writing anything.
+*/
+
+
+static PyObject *MIDIError;
+
+
+/************** Events ******************
+
+	An array of MIDIEvent, taken over from a MIDIFile, which it frees when it goes. It is read
+	only, as unsigned bytes; the record layout is EVENT_SIZE bytes as in midilib.h.
+*/
+
+typedef struct {
+	PyObject_HEAD
+	MIDIEvent 	*events;
+	Py_ssize_t 	num_events;
+} EventsObject;
+
+static void events_dealloc(EventsObject *self) {
+
+	free(self->events);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int events_getbuffer(EventsObject *self, Py_buffer *view, int flags) {
+
+	return PyBuffer_FillInfo(view, (PyObject*)self, self->events,
+	                         self->num_events * sizeof(MIDIEvent), 1, flags);
+}
+
+static Py_ssize_t events_length(EventsObject *self) {
+
+	return self->num_events;
+}
+
+static PyBufferProcs events_as_buffer = { (getbufferproc)events_getbuffer, NULL };
+static PySequenceMethods events_as_sequence = { (lenfunc)events_length };
+
+static PyTypeObject EventsType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "_midilib.Events",
+	.tp_basicsize = sizeof(EventsObject),
+	.tp_dealloc = (destructor)events_dealloc,
+	.tp_as_sequence = &events_as_sequence,
+	.tp_as_buffer = &events_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "The commands of a conversion in time order, as MIDIEvent records; use it as a buffer",
+};
+
+// hand midi->events over to a new Events object
+static PyObject *events_take(MIDIFile *midi) {
+
+	EventsObject *self = PyObject_New(EventsObject, &EventsType);
+	if (!self) return NULL;
+
+	self->events = midi->events;
+	self->num_events = midi->num_events;
+	midi->events = NULL;
+	midi->num_events = midi->events_mem = 0;
+	return (PyObject*)self;
+}
+
+
+/************** conversion ******************/
+
+static char *convert_keywords[] = { "", "channel_mask", "percussion_ignore", "notemin_usec", "releasetime_usec",
+                                    "start_usec", "end_usec", "decode_threads", "num_tonegens", "tonegen_per_track",
+                                    "output_format", NULL };
+#define CONVERT_OPTIONS "IpkkKKiipi"
+#define CONVERT_FORMAT "|$" CONVERT_OPTIONS
+
+
+// what module_convert_midi returns
+#define RESULT_BYTES 	0
+#define RESULT_EVENTS 	1	// an Events object
+#define RESULT_STATS 	2	// (bytes, dict)
+
+static const char *stage_names[NUM_STAGES] = { "headers_nsec", "merge_nsec", "queue_nsec", "output_nsec" };
+
+// a dict of the stats of the last conversion
+static PyObject *module_stats_dict(MIDIFile *midi) {
+
+	MIDIStats st;
+	midi_get_stats(midi, &st);
+
+	PyObject *dict = Py_BuildValue("{sIsIsIsIsK" "sIsIsI" "sIsIsIsIsIsI" "sIsIsIsIsK" "sK}",
+		"notes_started", st.notes_started, "notes_stopped", st.notes_stopped, "pedal_changes", st.pedal_changes,
+		"tempo_changes", st.tempo_changes, "length_usec", (unsigned long long)st.length_usec,
+		"queue_highwater", st.queue_highwater, "events_delayed", st.events_delayed,
+		"events_would_delay", st.events_would_delay,
+		"notes_unmatched", st.notes_unmatched, "notes_skipped", st.notes_skipped,
+		"notes_over_slots", st.notes_over_slots, "notes_playing_max", st.notes_playing_max,
+		"tonegens_used", st.tonegens_used, "instrument_changes", st.instrument_changes,
+		"commands_output", st.commands_output, "delays_output", st.delays_output,
+		"delays_merged", st.delays_merged, "consecutive_delays", st.consecutive_delays,
+		"output_bytes", (unsigned long long)st.output_bytes,
+		"total_nsec", (unsigned long long)st.total_nsec);
+
+	for (int stage = 0; dict && stage < NUM_STAGES; ++stage) {
+		PyObject *nsec = PyLong_FromUnsignedLongLong(st.stage_nsec[stage]);
+		if (!nsec || PyDict_SetItemString(dict, stage_names[stage], nsec) < 0) Py_CLEAR(dict);
+		Py_XDECREF(nsec);
+	}
+	return dict;
+}
+
+// the sink for the bytestream when only the events are wanted
+static int module_discard_output(void *arg, const byte *data, uint32_t len) {
+
+	return True;
+}
+
+// convert a loaded file into an Events object, with the GIL released while converting; the
+// bytestream goes a chunk at a time through the library's own small buffer, and is dropped
+static PyObject *module_convert_events(MIDIFile *midi) {
+
+	midi->collect_events = true;
+	midi_set_sink(midi, module_discard_output, NULL, 0);
+
+	int converted;
+	Py_BEGIN_ALLOW_THREADS
+	converted = midi_convert(midi);
+	Py_END_ALLOW_THREADS
+
+	if (!converted) {
+		PyErr_SetString(MIDIError, midi->error ? midi->error : "conversion failed");
+		return NULL;
+	}
+	return events_take(midi);
+}
+
+// convert a loaded file into a new bytes object, with the GIL released while converting;
+// or into one of the other RESULT_xxx
+static PyObject *module_convert_midi(MIDIFile *midi, int what) {
+
+	if (what == RESULT_EVENTS)
+		return module_convert_events(midi);
+
+	// conversion makes about as much output as there is track data, so that's within the file size
+	PyObject *result = PyBytes_FromStringAndSize(NULL, midi->data_len + 16);
+	if (!result) return NULL;
+
+	midi->output = (byte*)PyBytes_AS_STRING(result);
+	midi->output_mem = midi->data_len + 16 < UINT32_MAX ? midi->data_len + 16 : UINT32_MAX;
+	midi->output_borrowed = true;
+
+	midi->time_stages = what == RESULT_STATS;
+
+	int converted;
+	Py_BEGIN_ALLOW_THREADS
+	converted = midi_convert(midi);
+	Py_END_ALLOW_THREADS
+
+	if (!converted) {
+		PyErr_SetString(MIDIError, midi->error ? midi->error : "conversion failed");
+		Py_DECREF(result);
+		result = NULL;
+	}
+	else if (midi->output_borrowed) { // it fit: give back the space that wasn't used
+		_PyBytes_Resize(&result, midi->output_len);
+	}
+	else { // it outgrew the bytes object and moved to the library's own space
+		Py_DECREF(result);
+		result = PyBytes_FromStringAndSize((char*)midi->output, midi->output_len);
+	}
+
+	if (midi->output_borrowed) midi->output = NULL; // not for midi_free
+
+	if (result && what == RESULT_STATS) {
+		PyObject *stats = module_stats_dict(midi);
+		PyObject *pair = stats ? PyTuple_Pack(2, result, stats) : NULL;
+		Py_XDECREF(stats);
+		Py_DECREF(result);
+		result = pair;
+	}
+	return result;
+}
+
+static PyObject *module_convert_buffer(PyObject *args, PyObject *kwargs, int what) {
+
+	Py_buffer data;
+	MIDIOptions options;
+	midi_default_options(&options);
+	int percussion_ignore = options.percussion_ignore; // "p" fills in an int
+	int tonegen_per_track = options.tonegen_per_track; // so does this one
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*" CONVERT_FORMAT, convert_keywords, &data,
+	                                 &options.channel_mask, &percussion_ignore, &options.notemin_usec,
+	                                 &options.releasetime_usec, &options.start_usec, &options.end_usec,
+	                                 &options.decode_threads, &options.num_tonegens, &tonegen_per_track,
+	                                 &options.output_format))
+		return NULL;
+	options.percussion_ignore = percussion_ignore;
+	options.tonegen_per_track = tonegen_per_track;
+
+	MIDIFile *midi = midi_load_buffer(data.buf, data.len); // data stays exported, so it can't change under us
+	if (!midi) {
+		PyBuffer_Release(&data);
+		return PyErr_NoMemory();
+	}
+	midi->options = options;
+	PyObject *result = module_convert_midi(midi, what);
+
+	midi_free(midi);
+	PyBuffer_Release(&data);
+	return result;
+}
+
+static PyObject *module_convert_path(PyObject *args, PyObject *kwargs, int what) {
+
+	PyObject *path;
+	MIDIOptions options;
+	midi_default_options(&options);
+	int percussion_ignore = options.percussion_ignore; // "p" fills in an int
+	int tonegen_per_track = options.tonegen_per_track; // so does this one
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&" CONVERT_FORMAT, convert_keywords, PyUnicode_FSConverter, &path,
+	                                 &options.channel_mask, &percussion_ignore, &options.notemin_usec,
+	                                 &options.releasetime_usec, &options.start_usec, &options.end_usec,
+	                                 &options.decode_threads, &options.num_tonegens, &tonegen_per_track,
+	                                 &options.output_format))
+		return NULL;
+	options.percussion_ignore = percussion_ignore;
+	options.tonegen_per_track = tonegen_per_track;
+
+	MIDIFile *midi;
+	Py_BEGIN_ALLOW_THREADS
+	midi = midi_load(PyBytes_AS_STRING(path), MIDI_LOAD_MMAP);
+	Py_END_ALLOW_THREADS
+
+	if (!midi) {
+		PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+		Py_DECREF(path);
+		return NULL;
+	}
+	Py_DECREF(path);
+
+	midi->options = options;
+	PyObject *result = module_convert_midi(midi, what);
+
+	midi_free(midi);
+	return result;
+}
+
+static PyObject *module_convert(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	return module_convert_buffer(args, kwargs, RESULT_BYTES);
+}
+
+static PyObject *module_convert_file(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	return module_convert_path(args, kwargs, RESULT_BYTES);
+}
+
+static PyObject *module_events(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	return module_convert_buffer(args, kwargs, RESULT_EVENTS);
+}
+
+static PyObject *module_events_file(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	return module_convert_path(args, kwargs, RESULT_EVENTS);
+}
+
+static PyObject *module_convert_stats(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	return module_convert_buffer(args, kwargs, RESULT_STATS);
+}
+
+static PyObject *module_convert_file_stats(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	return module_convert_path(args, kwargs, RESULT_STATS);
+}
+
+
+
+static char *convert_many_keywords[] = { "inputs", "outputs", "workers", "channel_mask", "percussion_ignore",
+                                         "notemin_usec", "releasetime_usec", "start_usec", "end_usec",
+                                         "decode_threads", "num_tonegens", "tonegen_per_track", "output_format", NULL };
+
+// the paths of a sequence, as a list of bytes objects that stay alive while the batch runs
+static PyObject *module_paths(PyObject *sequence, const char *what) {
+
+	PyObject *fast = PySequence_Fast(sequence, what);
+	if (!fast) return NULL;
+
+	Py_ssize_t len = PySequence_Fast_GET_SIZE(fast);
+	PyObject *paths = PyList_New(len);
+	for (Py_ssize_t i = 0; paths && i < len; ++i) {
+		PyObject *path;
+		if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(fast, i), &path)) {
+			Py_CLEAR(paths);
+			break;
+		}
+		PyList_SET_ITEM(paths, i, path);
+	}
+
+	Py_DECREF(fast);
+	return paths;
+}
+
+static PyObject *module_convert_many(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+	PyObject *inputs, *outputs = Py_None;
+	int workers = 0;
+	MIDIOptions options;
+	midi_default_options(&options);
+	int percussion_ignore = options.percussion_ignore; // "p" fills in an int
+	int tonegen_per_track = options.tonegen_per_track; // so does this one
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$i" CONVERT_OPTIONS, convert_many_keywords, &inputs, &outputs,
+	                                 &workers, &options.channel_mask, &percussion_ignore, &options.notemin_usec,
+	                                 &options.releasetime_usec, &options.start_usec, &options.end_usec,
+	                                 &options.decode_threads, &options.num_tonegens, &tonegen_per_track,
+	                                 &options.output_format))
+		return NULL;
+	options.percussion_ignore = percussion_ignore;
+	options.tonegen_per_track = tonegen_per_track;
+
+	PyObject *in_paths = module_paths(inputs, "inputs must be a sequence of paths");
+	if (!in_paths) return NULL;
+	PyObject *out_paths = NULL;
+	if (outputs != Py_None) {
+		out_paths = module_paths(outputs, "outputs must be a sequence of paths");
+		if (!out_paths) {
+			Py_DECREF(in_paths);
+			return NULL;
+		}
+		if (PyList_GET_SIZE(out_paths) != PyList_GET_SIZE(in_paths)) {
+			PyErr_SetString(PyExc_ValueError, "there must be as many outputs as inputs");
+			Py_DECREF(in_paths);
+			Py_DECREF(out_paths);
+			return NULL;
+		}
+	}
+
+	int num_items = (int)PyList_GET_SIZE(in_paths);
+	MIDIBatchItem *items = (MIDIBatchItem*)calloc(num_items + 1, sizeof(MIDIBatchItem));
+	if (!items) {
+		Py_DECREF(in_paths);
+		Py_XDECREF(out_paths);
+		return PyErr_NoMemory();
+	}
+	for (int i = 0; i < num_items; ++i) {
+		items[i].midifile = PyBytes_AS_STRING(PyList_GET_ITEM(in_paths, i));
+		items[i].outfile = out_paths ? PyBytes_AS_STRING(PyList_GET_ITEM(out_paths, i)) : NULL;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	midi_binarize_batch(items, num_items, workers, &options, NULL);
+	Py_END_ALLOW_THREADS
+
+	PyObject *result = PyList_New(num_items);
+	for (int i = 0; result && i < num_items; ++i) {
+		PyObject *status = Py_BuildValue("(OzdKK)", items[i].result == 0 ? Py_True : Py_False, items[i].error,
+		                                 items[i].seconds, (unsigned long long)items[i].bytes_in,
+		                                 (unsigned long long)items[i].bytes_out);
+		if (!status) {
+			Py_CLEAR(result);
+			break;
+		}
+		PyList_SET_ITEM(result, i, status);
+	}
+
+	free(items);
+	Py_DECREF(in_paths);
+	Py_XDECREF(out_paths);
+	return result;
+}
+
+
+static PyMethodDef module_methods[] = {
+	{ "convert", (PyCFunction)(void(*)(void))module_convert, METH_VARARGS | METH_KEYWORDS,
+	  "convert(data, **options) -> bytes\n\nConvert MIDI file data, in anything with the buffer protocol." },
+	{ "convert_file", (PyCFunction)(void(*)(void))module_convert_file, METH_VARARGS | METH_KEYWORDS,
+	  "convert_file(path, **options) -> bytes\n\nConvert a MIDI file." },
+	{ "events", (PyCFunction)(void(*)(void))module_events, METH_VARARGS | METH_KEYWORDS,
+	  "events(data, **options) -> Events\n\nConvert MIDI file data, returning the commands output in time order." },
+	{ "events_file", (PyCFunction)(void(*)(void))module_events_file, METH_VARARGS | METH_KEYWORDS,
+	  "events_file(path, **options) -> Events\n\nConvert a MIDI file, returning the commands output in time order." },
+	{ "convert_stats", (PyCFunction)(void(*)(void))module_convert_stats, METH_VARARGS | METH_KEYWORDS,
+	  "convert_stats(data, **options) -> (bytes, dict)\n\nConvert MIDI file data, with the statistics of the conversion." },
+	{ "convert_file_stats", (PyCFunction)(void(*)(void))module_convert_file_stats, METH_VARARGS | METH_KEYWORDS,
+	  "convert_file_stats(path, **options) -> (bytes, dict)\n\nConvert a MIDI file, with the statistics of the conversion." },
+	{ "convert_many", (PyCFunction)(void(*)(void))module_convert_many, METH_VARARGS | METH_KEYWORDS,
+	  "convert_many(inputs, outputs=None, *, workers=0, **options) -> list\n\n"
+	  "Convert MIDI files on a pool of native threads, returning (ok, error, seconds, bytes_in, bytes_out) for each." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef module_def = {
+	PyModuleDef_HEAD_INIT, "_midilib", "MIDI to bytestream conversion", -1, module_methods
+};
+
+PyMODINIT_FUNC PyInit__midilib(void) {
+
+	if (PyType_Ready(&EventsType) < 0) return NULL;
+
+	PyObject *module = PyModule_Create(&module_def);
+	if (!module) return NULL;
+
+	MIDIError = PyErr_NewException("_midilib.MIDIError", PyExc_ValueError, NULL);
+	if (!MIDIError || PyModule_AddObject(module, "MIDIError", MIDIError) < 0) {
+		Py_XDECREF(MIDIError);
+		Py_DECREF(module);
+		return NULL;
+	}
+	Py_INCREF(MIDIError); // the module's reference was taken by PyModule_AddObject
+
+	Py_INCREF(&EventsType);
+	PyModule_AddObject(module, "Events", (PyObject*)&EventsType);
+	PyModule_AddIntConstant(module, "EVENT_SIZE", sizeof(MIDIEvent));
+	PyModule_AddIntConstant(module, "FORMAT_CLASSIC", MIDI_FORMAT_CLASSIC);
+	PyModule_AddIntConstant(module, "FORMAT_COMPACT", MIDI_FORMAT_COMPACT);
+	PyModule_AddStringConstant(module, "VERSION", VERSION);
+	return module;
+}
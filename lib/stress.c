@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "midilib.h"
+
+
+/*
+	Thread-safety stress test.
+
+	Usage: stress [-j threads] [-r rounds] dir
+
+	Every .mid file in dir is converted once on this thread with each of the stress_options, for
+	the reference output. Then the threads all convert every file with every set of options again,
+	each in its own order, in each of the ways the library offers: midi_binarize_buffer from memory,
+	midi_binarize_opt to a file, and a MIDIFile of the thread's own reused with midi_reset, with a
+	trace ring hooked up and the output commands collected and described. Last, midi_binarize_batch
+	converts them all on its pool. An output that isn't the reference is reported and fails the run,
+	and so does a file that converts with the default options but not with some of the others.
+
+	"make stress" builds it with -fsanitize=thread, both as a release and a DEBUG build, in which
+	the trace hook is called, and runs it on a corpus from "bench corpus"; a data race then fails
+	the run too.
+*/
+
+#define STRESS_OPTIONS 5
+
+typedef struct stress_file StressFile;
+struct stress_file {
+
+	char 		*path;
+	byte 		*data;
+	size_t 		len;
+	int 		result[STRESS_OPTIONS];		// of the reference conversion, 0 if it worked
+	byte 		*output[STRESS_OPTIONS];	// and its output
+	size_t 		output_len[STRESS_OPTIONS];
+};
+
+typedef struct stress_job StressJob;
+struct stress_job {
+
+	StressFile 	*files;
+	int 		num_files;
+	int 		rounds;
+	const char 	*tmpdir;
+	MIDIOptions options[STRESS_OPTIONS];
+	int 		failed;
+};
+
+typedef struct stress_thread StressThread;
+struct stress_thread {
+
+	StressJob 	*job;
+	int 		num;
+	pthread_t 	thread;
+};
+
+
+// all of a file, in a malloc'd buffer
+byte *stress_read(const char *path, size_t *len) {
+
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+
+	size_t mem = 65536;
+	byte *data = (byte*)malloc(mem);
+	*len = 0;
+	size_t got;
+	while ((got = fread(data + *len, 1, mem - *len, f)) > 0) {
+		*len += got;
+		if (*len == mem) data = (byte*)realloc(data, mem *= 2);
+	}
+	fclose(f);
+	return data;
+}
+
+void stress_options(MIDIOptions *options) {
+
+	for (int opt = 0; opt < STRESS_OPTIONS; ++opt)
+		midi_default_options(&options[opt]);
+
+	options[1].releasetime_usec = 20000;
+	options[1].num_tonegens = 4;
+	options[1].tonegen_per_track = true;
+	options[2].output_format = MIDI_FORMAT_COMPACT;
+	options[2].notemin_usec = 1000;
+	options[3].decode_threads = 2;	// the threaded index, on threads of its own
+	options[4].start_usec = 2000000;
+	options[4].end_usec = 6000000;
+	options[4].channel_mask = 0x00ff;
+}
+
+// does a conversion match the reference? reports it if not
+int stress_check(StressJob *job, StressFile *file, int opt, const char *how, int result, const byte *output, size_t len) {
+
+	if (result == file->result[opt] && (result != 0 || (len == file->output_len[opt]
+	    && memcmp(output, file->output[opt], len) == 0)))
+		return True;
+
+	fprintf(stderr, "%s, options %d, %s: result %d, %lu bytes; the reference is result %d, %lu bytes\n",
+	        file->path, opt, how, result, (unsigned long)len, file->result[opt], (unsigned long)file->output_len[opt]);
+	__atomic_store_n(&job->failed, True, __ATOMIC_RELAXED);
+	return False;
+}
+
+// convert with the thread's own MIDIFile, tracing it and describing every command output
+void stress_convert_midi(StressJob *job, MIDIFile *midi, MIDITraceRing *ring, StressFile *file, int opt, int load_mode) {
+
+	midi_reset(midi);
+	if (!midi_load_into(midi, file->path, load_mode)) {
+		stress_check(job, file, opt, "midi_load_into", -1, NULL, 0);
+		return;
+	}
+	midi->options = job->options[opt];
+	midi->collect_events = true;
+	midi_set_trace(midi, midi_trace_to_ring, ring);
+
+	int result = midi_convert(midi) ? 0 : -1;
+	stress_check(job, file, opt, load_mode == MIDI_LOAD_MMAP ? "midi_convert, mapped" : "midi_convert, read",
+	             result, midi->output, midi->output_len);
+
+	char description[DESCRIBE_LEN];
+	for (uint32_t e = 0; result == 0 && e < midi->num_events; ++e) {
+		MIDIEvent *ev = &midi->events[e];
+		NoteInfo note = { ev->time_usec, ev->track, ev->channel, ev->note, ev->instrument, ev->volume };
+		describe(&note, description);
+	}
+}
+
+void *stress_worker(void *arg) {
+
+	StressThread *me = (StressThread*)arg;
+	StressJob *job = me->job;
+	int total = job->num_files * STRESS_OPTIONS;
+
+	char outfile[1024];
+	snprintf(outfile, sizeof(outfile), "%s/thread_%d.bin", job->tmpdir, me->num);
+
+	MIDIFile *midi = (MIDIFile*)calloc(sizeof(MIDIFile), 1);
+	MIDITraceRing ring;
+	midi_trace_ring_init(&ring, 1024);
+
+	for (int round = 0; round < job->rounds; ++round) {
+		for (int k = 0; k < total; ++k) {
+
+			int n = (k + 7 * me->num) % total; // each thread in its own order
+			StressFile *file = &job->files[n / STRESS_OPTIONS];
+			int opt = n % STRESS_OPTIONS;
+			const MIDIOptions *options = &job->options[opt];
+
+			switch ((k + me->num + round) % 4) {
+			case 0: {
+				byte *output = NULL;
+				size_t len = 0;
+				int result = midi_binarize_buffer(file->data, file->len, &output, &len, 0, options);
+				stress_check(job, file, opt, "midi_binarize_buffer", result, output, len);
+				free(output);
+				break;
+			}
+			case 1: {
+				int result = midi_binarize_opt(file->path, outfile, options);
+				size_t len = 0;
+				byte *output = result == 0 ? stress_read(outfile, &len) : NULL;
+				stress_check(job, file, opt, "midi_binarize_opt", result, output, len);
+				free(output);
+				break;
+			}
+			case 2:
+				stress_convert_midi(job, midi, &ring, file, opt, MIDI_LOAD_MMAP);
+				break;
+			case 3:
+				stress_convert_midi(job, midi, &ring, file, opt, MIDI_LOAD_READ);
+				break;
+			}
+		}
+	}
+
+	midi_trace_ring_free(&ring);
+	midi_free(midi);
+	remove(outfile);
+	return NULL;
+}
+
+// midi_binarize_batch on its own pool, with the first options, checked against the reference
+void stress_batch(StressJob *job, int num_threads) {
+
+	MIDIBatchItem *items = (MIDIBatchItem*)calloc(job->num_files, sizeof(MIDIBatchItem));
+	char **outfiles = (char**)malloc(sizeof(char*) * job->num_files);
+
+	for (int f = 0; f < job->num_files; ++f) {
+		outfiles[f] = (char*)malloc(1024);
+		snprintf(outfiles[f], 1024, "%s/batch_%d.bin", job->tmpdir, f);
+		items[f].midifile = job->files[f].path;
+		items[f].outfile = outfiles[f];
+	}
+
+	MIDIBatchStats stats;
+	midi_binarize_batch(items, job->num_files, num_threads, &job->options[0], &stats);
+
+	for (int f = 0; f < job->num_files; ++f) {
+		size_t len = 0;
+		byte *output = items[f].result == 0 ? stress_read(outfiles[f], &len) : NULL;
+		stress_check(job, &job->files[f], 0, "midi_binarize_batch", items[f].result, output, len);
+		free(output);
+		remove(outfiles[f]);
+		free(outfiles[f]);
+	}
+	free(outfiles);
+	free(items);
+}
+
+
+int main(int argc, char *argv[]) {
+
+	int num_threads = 4, rounds = 2;
+	const char *dirname = NULL;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) num_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+		else dirname = argv[i];
+	}
+	DIR *dir = dirname ? opendir(dirname) : NULL;
+	if (!dir || num_threads < 1) {
+		fprintf(stderr, "usage: stress [-j threads] [-r rounds] dir\n");
+		return 1;
+	}
+
+	StressJob job = {0};
+	job.rounds = rounds;
+	stress_options(job.options);
+
+	int mem = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		const char *ext = strrchr(ent->d_name, '.');
+		if (!ext || strcmp(ext, ".mid") != 0) continue;
+		if (job.num_files == mem) {
+			mem = mem ? 2 * mem : 64;
+			job.files = (StressFile*)realloc(job.files, sizeof(StressFile) * mem);
+		}
+		StressFile *file = &job.files[job.num_files];
+		memset(file, 0, sizeof(StressFile));
+		file->path = (char*)malloc(strlen(dirname) + strlen(ent->d_name) + 2);
+		sprintf(file->path, "%s/%s", dirname, ent->d_name);
+		if (!(file->data = stress_read(file->path, &file->len))) {
+			perror(file->path);
+			return 1;
+		}
+		++job.num_files;
+	}
+	closedir(dir);
+	if (job.num_files == 0) {
+		fprintf(stderr, "no .mid files in %s\n", dirname);
+		return 1;
+	}
+
+	// the reference, converted on this thread alone; a file that converts with the defaults
+	// has to convert with all the options
+	for (int f = 0; f < job.num_files; ++f) {
+		StressFile *file = &job.files[f];
+		for (int opt = 0; opt < STRESS_OPTIONS; ++opt) {
+			file->result[opt] = midi_binarize_buffer(file->data, file->len, &file->output[opt], &file->output_len[opt], 0,
+			                                         &job.options[opt]);
+			if (file->result[0] == 0 && file->result[opt] != 0) {
+				fprintf(stderr, "%s: converts with the default options, but not with options %d\n", file->path, opt);
+				job.failed = True;
+			}
+		}
+	}
+
+	char tmpdir[] = "/tmp/midistressXXXXXX";
+	if (!mkdtemp(tmpdir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	job.tmpdir = tmpdir;
+
+	StressThread *threads = (StressThread*)calloc(num_threads, sizeof(StressThread));
+	for (int t = 0; t < num_threads; ++t) {
+		threads[t].job = &job;
+		threads[t].num = t;
+		if (pthread_create(&threads[t].thread, NULL, stress_worker, &threads[t]) != 0) {
+			fprintf(stderr, "can't start thread %d\n", t);
+			return 1;
+		}
+	}
+	for (int t = 0; t < num_threads; ++t) pthread_join(threads[t].thread, NULL);
+	free(threads);
+
+	stress_batch(&job, num_threads);
+	rmdir(tmpdir);
+
+	fprintf(stderr, "%d files, %d sets of options, %d threads, %d rounds: %s\n", job.num_files, STRESS_OPTIONS,
+	        num_threads, rounds, job.failed ? "FAILED" : "ok");
+
+	for (int f = 0; f < job.num_files; ++f) {
+		for (int opt = 0; opt < STRESS_OPTIONS; ++opt) free(job.files[f].output[opt]);
+		free(job.files[f].data);
+		free(job.files[f].path);
+	}
+	free(job.files);
+	return job.failed ? 1 : 0;
+}
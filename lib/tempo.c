@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midilib.h"
+
+
+/*
+	Tempo map.
+
+	The tempo changes of a score, in tick order, each with the time in usec at which it happens.
+	Any tick is then converted to usec by finding the last change at or before it, with a binary
+	search, and going on from there at that tempo; and usec back to ticks the same way. Since
+	every segment starts from the exact time of its tempo change, the rounding doesn't build up
+	along the score the way it does when the time is advanced a little at a time.
+
+	midi_convert fills in midi->tempo_map as the merge comes to each tempo change, which only
+	ever looks at the last segment. To convert times before converting, or to start converting
+	in the middle, midi_build_tempo_map makes the whole map from the event index.
+*/
+
+
+/// Start an empty map, which is at the default tempo from tick 0; False if there's no memory for it
+int midi_tempo_map_init(MIDITempoMap *map, uint32_t ticks_per_beat) {
+
+	map->len = 0;
+	map->complete = false;
+	map->ticks_per_beat = ticks_per_beat ? ticks_per_beat : DEFAULT_BEATTIME;
+	return midi_tempo_map_add(map, 0, DEFAULT_TEMPO);
+}
+
+void midi_tempo_map_free(MIDITempoMap *map) {
+
+	midi_arena_drop(map->arena, map->changes);
+	map->changes = NULL;
+	map->len = map->mem = 0;
+	map->complete = false;
+}
+
+/// Add a tempo change, at or after the last one; a change at the same tick replaces it.
+/// Returns False, with the map as it was, if there's no memory for it.
+int midi_tempo_map_add(MIDITempoMap *map, uint64_t tick, uint32_t tempo) {
+
+	if (map->len > 0 && map->changes[map->len - 1].tick >= tick) {
+		map->changes[map->len - 1].tempo = tempo;
+		return True;
+	}
+
+	if (map->len == map->mem) {
+		int mem = map->mem ? 2 * map->mem : 16;
+		MIDITempoChange *changes = (MIDITempoChange*)midi_arena_grow(map->arena, map->changes,
+		                                                             sizeof(MIDITempoChange) * map->mem, sizeof(MIDITempoChange) * mem);
+		if (!changes) return False;
+		map->changes = changes;
+		map->mem = mem;
+	}
+
+	MIDITempoChange *change = &map->changes[map->len];
+	change->tick = tick;
+	change->usec = map->len > 0 ? midi_tempo_map_usec(map, tick) : 0;
+	change->tempo = tempo;
+	map->len++;
+	return True;
+}
+
+// the last change at or before tick
+MIDITempoChange *tempo_map_find_tick(MIDITempoMap *map, uint64_t tick) {
+
+	int lo = 0, hi = map->len - 1;
+	if (map->changes[hi].tick <= tick) return &map->changes[hi]; // going forward, it's usually the last
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (map->changes[mid].tick <= tick) lo = mid;
+		else hi = mid - 1;
+	}
+	return &map->changes[lo];
+}
+
+// the last change at or before usec
+MIDITempoChange *tempo_map_find_usec(MIDITempoMap *map, uint64_t usec) {
+
+	int lo = 0, hi = map->len - 1;
+	if (map->changes[hi].usec <= usec) return &map->changes[hi];
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (map->changes[mid].usec <= usec) lo = mid;
+		else hi = mid - 1;
+	}
+	return &map->changes[lo];
+}
+
+/// The time of a tick, in usec since the start of the score
+uint64_t midi_tempo_map_usec(MIDITempoMap *map, uint64_t tick) {
+
+	MIDITempoChange *change = tempo_map_find_tick(map, tick);
+	return change->usec + (tick - change->tick) * change->tempo / map->ticks_per_beat;
+}
+
+/// The tempo in effect at a tick
+uint32_t midi_tempo_map_tempo(MIDITempoMap *map, uint64_t tick) {
+
+	return tempo_map_find_tick(map, tick)->tempo;
+}
+
+/// The last tick whose time, as midi_tempo_map_usec gives it, is at or before usec
+uint64_t midi_tempo_map_ticks(MIDITempoMap *map, uint64_t usec) {
+
+	MIDITempoChange *change = tempo_map_find_usec(map, usec);
+	if (change->tempo == 0) return change->tick; // a broken file; time stands still
+
+	// the most ticks d for which d * tempo / ticks_per_beat, rounded down, is still within usec
+	return change->tick + ((usec - change->usec + 1) * map->ticks_per_beat - 1) / change->tempo;
+}
+
+
+typedef struct tempo_event TempoEvent;
+struct tempo_event {
+
+	uint64_t 	tick;
+	uint32_t 	tempo;
+	int 		order;		// to keep the file order for changes at the same tick
+};
+
+int tempo_event_before(const void *a, const void *b) {
+
+	const TempoEvent *ta = (const TempoEvent*)a, *tb = (const TempoEvent*)b;
+	if (ta->tick != tb->tick) return (ta->tick > tb->tick) - (ta->tick < tb->tick);
+	return ta->order - tb->order;
+}
+
+/// Make the whole of midi->tempo_map from the event index, building the index if there is none
+int midi_build_tempo_map(MIDIFile *midi) {
+
+	if (!midi->index && !midi_build_index(midi))
+		return False;
+
+	MIDIEventIndex *ndx = midi->index;
+	int count = 0;
+	for (int e = 0; e < ndx->num_events; ++e)
+		if (ndx->cmd[e] == CMD_TEMPO) ++count;
+
+	// the tracks' changes, merged into tick order
+	TempoEvent *events = (TempoEvent*)malloc(sizeof(TempoEvent) * (count + 1));
+	if (!events) return midi_fail(midi, "out of memory");
+	count = 0;
+	for (int e = 0; e < ndx->num_events; ++e) {
+		if (ndx->cmd[e] != CMD_TEMPO) continue;
+		events[count].tick = ndx->time[e];
+		events[count].tempo = ndx->value[e];
+		events[count].order = count;
+		++count;
+	}
+	qsort(events, count, sizeof(TempoEvent), tempo_event_before);
+
+	int added = midi_tempo_map_init(&midi->tempo_map, midi->ticks_per_beat);
+	for (int i = 0; added && i < count; ++i)
+		added = midi_tempo_map_add(&midi->tempo_map, events[i].tick, events[i].tempo);
+	midi->tempo_map.complete = added;
+
+	free(events);
+	return added ? True : midi_fail(midi, "out of memory");
+}
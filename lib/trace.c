@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "midilib.h"
+
+
+/*
+	Trace hooks.
+
+	The conversion only calls midi_trace_emit in DEBUG builds, through the MIDI_TRACE macro in
+	midilib.c, and only when a hook is set. Two hooks are provided: midi_trace_to_file prints each
+	event as it happens, and midi_trace_to_ring keeps the latest ones in a fixed-size binary ring,
+	which is cheap enough to leave on and look at after something goes wrong.
+*/
+
+
+void midi_set_trace(MIDIFile *midi, MIDITraceFn trace, void *arg) {
+
+	midi->trace = trace;
+	midi->trace_arg = arg;
+}
+
+void midi_trace_emit(MIDIFile *midi, byte kind, byte cmd, int track, byte chan, byte note, uint32_t value, uint64_t time) {
+
+	MIDITrace trace;
+	trace.time = time;
+	trace.value = value;
+	trace.kind = kind;
+	trace.cmd = cmd;
+	trace.track = (byte)track;
+	trace.chan = chan;
+	trace.note = note;
+
+	midi->trace(midi->trace_arg, &trace);
+}
+
+/// print a trace event in human-readable form
+void midi_trace_print(FILE *fid, const MIDITrace *tr) {
+
+	unsigned long msec = tr->time / 1000, usec = tr->time % 1000;
+
+	switch (tr->kind) {
+
+	case TRACE_FILE_HEADER:
+		fprintf(fid, "format type %d, %u tracks, %lu ticks/beat\n", tr->note, tr->value, (unsigned long)tr->time);
+		break;
+	case TRACE_TRACK_HEADER:
+		fprintf(fid, "track %d length %u\n", tr->track, tr->value);
+		break;
+	case TRACE_PARSE_NOTE_OFF:
+		fprintf(fid, "# trk %d at %lu ticks: note %d (0x%02X) off, channel %d, volume %u\n",
+		        tr->track, (unsigned long)tr->time, tr->note, tr->note, tr->chan, tr->value);
+		break;
+	case TRACE_PARSE_NOTE_ON:
+		fprintf(fid, "# trk %d at %lu ticks: note %d (0x%02X) on,  channel %d, volume %u\n",
+		        tr->track, (unsigned long)tr->time, tr->note, tr->note, tr->chan, tr->value);
+		break;
+	case TRACE_PARSE_META:
+		fprintf(fid, "# trk %d at %lu ticks: meta event %02X, length %u\n", tr->track, (unsigned long)tr->time, tr->note, tr->value);
+		break;
+	case TRACE_PARSE_TEMPO:
+		fprintf(fid, "# trk %d at %lu ticks: SET TEMPO %u usec/qnote\n", tr->track, (unsigned long)tr->time, tr->value);
+		break;
+	case TRACE_PARSE_KEY_PRESSURE:
+		fprintf(fid, "# trk %d at %lu ticks: channel %d: note %d (0x%02X) has key pressure %u\n",
+		        tr->track, (unsigned long)tr->time, tr->chan, tr->note, tr->note, tr->value);
+		break;
+	case TRACE_PARSE_CONTROL:
+		fprintf(fid, "# trk %d at %lu ticks: channel %d: change control value of controller %d to %u\n",
+		        tr->track, (unsigned long)tr->time, tr->chan, tr->note, tr->value);
+		break;
+	case TRACE_PARSE_PROGRAM:
+		fprintf(fid, "# trk %d at %lu ticks: channel %d: program patch to instrument %u\n",
+		        tr->track, (unsigned long)tr->time, tr->chan, tr->value);
+		break;
+	case TRACE_PARSE_PRESSURE:
+		fprintf(fid, "# trk %d at %lu ticks: channel %d: after-touch pressure is %u\n",
+		        tr->track, (unsigned long)tr->time, tr->chan, tr->value);
+		break;
+	case TRACE_PARSE_PITCHBEND:
+		fprintf(fid, "# trk %d at %lu ticks: channel %d: pitch wheel change to %u\n",
+		        tr->track, (unsigned long)tr->time, tr->chan, tr->value);
+		break;
+	case TRACE_PARSE_SYSEX:
+		fprintf(fid, "# trk %d at %lu ticks: SysEx event %d with %u bytes\n", tr->track, (unsigned long)tr->time, tr->note, tr->value);
+		break;
+	case TRACE_MERGE:
+		fprintf(fid, "EN ->process trk %d at time %lu.%03lu msec (%u ticks)\n", tr->track, msec, usec, tr->value);
+		break;
+	case TRACE_MERGE_TEMPO:
+		fprintf(fid, "EN  tempo set to %u usec/qnote\n", tr->value);
+		break;
+	case TRACE_NOTE_NOT_FOUND:
+		fprintf(fid, "EN  *** noteinfo slot not found to stop track %d note %d (%02X) channel %d\n", tr->track, tr->note, tr->note, tr->chan);
+		break;
+	case TRACE_QUEUE:
+		fprintf(fid, "EN  queue %02X at %lu.%03lu msec, note %d (0x%02X) track %d channel %d volume %u\n",
+		        tr->cmd, msec, usec, tr->note, tr->note, tr->track, tr->chan, tr->value);
+		break;
+	case TRACE_QUEUE_DELAYED:
+		fprintf(fid, "EN  event delayed by %u usec\n", tr->value);
+		break;
+	case TRACE_PULL:
+		fprintf(fid, "EN    <-pull from queue at %lu.%03lu msec; deficit is %u usec\n", msec, usec, tr->value);
+		break;
+	case TRACE_OUTPUT:
+		fprintf(fid, "EN      output %02X at %lu.%03lu msec, note %d (0x%02X) volume %u\n", tr->cmd, msec, usec, tr->note, tr->note, tr->value);
+		break;
+	case TRACE_DELAY:
+		fprintf(fid, "EN      at %lu.%03lu msec, delay for %u msec\n", msec, usec, tr->value);
+		break;
+	case TRACE_CONSECUTIVE_DELAY:
+		fprintf(fid, "EN      *** this is a consecutive delay, of %u msec\n", tr->value);
+		break;
+	case TRACE_NO_TONEGEN:
+		fprintf(fid, "EN      *** at %lu.%03lu msec no free generator; skipping track %d note %d (0x%02X) channel %d\n",
+		        msec, usec, tr->track, tr->note, tr->note, tr->chan);
+		break;
+	case TRACE_END:
+		fprintf(fid, "EN ending at %lu.%03lu msec, with a final delay of %u msec\n", msec, usec, tr->value);
+		break;
+	default:
+		fprintf(fid, "unknown trace event %02X\n", tr->kind);
+	}
+}
+
+/// hook that prints every event; arg is a FILE*
+void midi_trace_to_file(void *arg, const MIDITrace *trace) {
+
+	midi_trace_print((FILE*)arg, trace);
+}
+
+/// size is rounded up to a power of two
+int midi_trace_ring_init(MIDITraceRing *ring, uint32_t size) {
+
+	uint32_t pow2 = 1;
+	while (pow2 < size) pow2 <<= 1;
+
+	ring->entries = (MIDITrace*)malloc(sizeof(MIDITrace) * pow2);
+	ring->size = ring->entries ? pow2 : 0;
+	ring->count = 0;
+	return ring->entries != NULL;
+}
+
+void midi_trace_ring_free(MIDITraceRing *ring) {
+
+	free(ring->entries);
+	ring->entries = NULL;
+	ring->size = 0;
+}
+
+/// hook that keeps the latest events; arg is a MIDITraceRing*
+void midi_trace_to_ring(void *arg, const MIDITrace *trace) {
+
+	MIDITraceRing *ring = (MIDITraceRing*)arg;
+	ring->entries[ring->count++ & (ring->size - 1)] = *trace;
+}
+
+
+/*
+	Stage timing, which midi_convert does with time_stages set (see the MIDI_STAGE macro). It is
+	a test of a bool where it isn't on, so unlike the trace points it isn't compiled out. In the
+	merge loop only the sampled events are timed, into stage_nsec, with the times from before
+	the loop put aside, and at the end of the loop its whole time is shared out in proportion.
+*/
+
+uint64_t stage_clock(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Start adding up the stage times afresh, in the given stage
+void midi_stage_start(MIDIFile *midi, int stage) {
+
+	memset(midi->stage_nsec, 0, sizeof(midi->stage_nsec));
+	midi->stage_timing = true;
+	midi->stage = STAGE_NONE;
+	midi_stage_switch(midi, stage);
+}
+
+/// Charge the time since the last switch to the stage it was in, and go on to another
+void midi_stage_switch(MIDIFile *midi, int stage) {
+
+	uint64_t now = stage_clock();
+	if (midi->stage < NUM_STAGES) midi->stage_nsec[midi->stage] += now - midi->stage_since;
+	midi->stage = stage;
+	midi->stage_since = now;
+}
+
+/// The merge loop is starting, so from now on only the sampled events are timed
+void midi_stage_loop_start(MIDIFile *midi) {
+
+	midi_stage_switch(midi, STAGE_NONE);
+	midi->stage_loop_since = midi->stage_since;
+	memcpy(midi->stage_outside_nsec, midi->stage_nsec, sizeof(midi->stage_nsec));
+	memset(midi->stage_nsec, 0, sizeof(midi->stage_nsec));
+	midi->stage_timing = false;
+	midi->stage_countdown = 1; // the first event is a sample
+	midi->stage_random = 12345;
+}
+
+/// The merge loop's countdown ran out: start timing an event, or stop after one and wait for the next
+void midi_stage_loop_sample(MIDIFile *midi) {
+
+	if (midi->stage_timing) {
+		midi_stage_switch(midi, STAGE_NONE);
+		midi->stage_timing = false;
+		midi->stage_random = midi->stage_random * 1664525 + 1013904223;
+		midi->stage_countdown = 1 + (midi->stage_random >> 24) % (2 * STAGE_SAMPLE - 1); // 1 to 2*STAGE_SAMPLE-1
+	}
+	else {
+		midi->stage_timing = true;
+		midi_stage_switch(midi, STAGE_MERGE);
+		midi->stage_countdown = 1;
+	}
+}
+
+/// The merge loop is done: share its time out as the samples were, and time everything again
+void midi_stage_loop_end(MIDIFile *midi, int stage) {
+
+	if (midi->stage_timing) midi_stage_switch(midi, STAGE_NONE);
+	uint64_t now = stage_clock();
+
+	uint64_t loop_nsec = now - midi->stage_loop_since, sampled_nsec = 0;
+	for (int s = 0; s < NUM_STAGES; ++s) sampled_nsec += midi->stage_nsec[s];
+	for (int s = 0; s < NUM_STAGES; ++s) {
+		uint64_t share = sampled_nsec ? (uint64_t)((double)midi->stage_nsec[s] * loop_nsec / sampled_nsec)
+		                              : s == STAGE_MERGE ? loop_nsec : 0;
+		midi->stage_nsec[s] = midi->stage_outside_nsec[s] + share;
+	}
+
+	midi->stage_timing = true;
+	midi->stage = stage;
+	midi->stage_since = now;
+}
@@ -1,54 +1,93 @@
-from ctypes import *
+"""
+	convert(data, **options) -> bytes: convert MIDI file data from bytes, bytearray, memoryview, ...
+	convert_file(path, **options) -> bytes: convert a MIDI file
+
+	The options are channel_mask, percussion_ignore, notemin_usec, releasetime_usec, start_usec,
+	end_usec, decode_threads, num_tonegens, tonegen_per_track and output_format (FORMAT_CLASSIC
+	or FORMAT_COMPACT), as in MIDIOptions. A broken file raises MIDIError, which is a ValueError;
+	a file that can't be read raises OSError.
+
+	convert_stats(data, **options) -> (bytes, dict): convert, with the statistics of the conversion
+	convert_file_stats(path, **options) -> (bytes, dict): the same for a MIDI file
+
+	The dict has the counts of MIDIStats (notes_started, notes_skipped, queue_highwater,
+	events_would_delay, output_bytes, ...) and the time of each stage in nsec (headers_nsec,
+	merge_nsec, queue_nsec, output_nsec and total_nsec), as plain ints, ready to send on.
+
+	events(data, **options) -> numpy array: the commands that went into the bytestream, in time order
+	events_file(path, **options) -> numpy array: the same for a MIDI file
+
+	The arrays are of event_dtype(), with fields time_usec, track, channel, note, instrument, volume
+	(the value, for a pedal), cmd and tonegen, and use the converter's own memory rather than a copy.
+
+	convert_many(inputs, outputs=None, workers=0, **options) -> [ConvertResult]: convert a list
+	of files on a pool of native threads (workers=0 for one per processor), with the GIL released
+	for the whole batch, and return how each one went, in order. With outputs=None the files are
+	converted but nothing is written.
+"""
+
+import os
 import sys
+from collections import namedtuple
+
+# the _midilib extension is built in lib/ with "make python"
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "lib"))
+
+import _midilib
+from _midilib import FORMAT_CLASSIC, FORMAT_COMPACT, MIDIError, convert, convert_file, convert_stats, convert_file_stats
+
 
 
-lib = CDLL("./lib/libmidilib.so")
-lib.midi_binarize.argtypes = [c_char_p, c_char_p]
-lib.midi_binarize.restype = c_int
+_event_dtype = None
 
+def event_dtype(): # numpy is only imported when it's needed
 
+	global _event_dtype
+	if _event_dtype is None:
+		import numpy
+		_event_dtype = numpy.dtype({
+			"names": ["time_usec", "track", "channel", "note", "instrument", "volume", "cmd", "tonegen"],
+			"formats": ["<u8", "<i4", "<i4", "<i4", "<i4", "<i4", "u1", "u1"],
+			"offsets": [0, 8, 12, 16, 20, 24, 28, 29],
+			"itemsize": _midilib.EVENT_SIZE })
+	return _event_dtype
 
-class float3(Structure):
-	_fields_ = [
-		("x", c_float),
-		("y", c_float),
-		("z", c_float)
-	]
 
-	def __init__(self, arr):
-		self.x = c_float(arr[0])
-		self.y = c_float(arr[1])
-		self.z = c_float(arr[2])
 
-	def __str__(self):
-		return "[{}, {}, {}]".format(self.x, self.y, self.z)
+def events(data, **options):
 
-	def toArray(self):
-		return [self.x, self.y, self.z]
+	import numpy
+	return numpy.frombuffer(_midilib.events(data, **options), dtype=event_dtype())
 
-float3_p = POINTER(float3)
 
 
+def events_file(path, **options):
 
+	import numpy
+	return numpy.frombuffer(_midilib.events_file(path, **options), dtype=event_dtype())
 
 
 
-class MIDI2BIN(Structure):
+ConvertResult = namedtuple("ConvertResult", "input output ok error seconds bytes_in bytes_out")
 
-	_fields_ = []
+def convert_many(inputs, outputs=None, workers=0, **options):
 
+	inputs = list(inputs)
+	outputs = list(outputs) if outputs is not None else None
+	results = _midilib.convert_many(inputs, outputs, workers=workers, **options)
+	return [ConvertResult(inputs[i], outputs[i] if outputs is not None else None, *result)
+	        for i, result in enumerate(results)]
 
-	def __init__(self):
 
-		self.lib = CDLL("libmidilib.so")
 
+def binarize(filein, fileout, **options):
 
+	data = convert_file(filein, **options)
+	with open(fileout, "wb") as fout:
+		fout.write(data)
 
-def MIDI_Binaryze(filein, fileout):
 
-	fmidi = c_char_p(filein.encode("utf-8"))
-	fout = c_char_p(fileout.encode("utf-8"))
-	lib.midi_binarize(fmidi, fout) 
 
+def MIDI_Binaryze(filein, fileout): # the old name
 
-	return
+	binarize(filein, fileout)